@@ -0,0 +1,359 @@
+// Builds the cursor alias index used by wlcursorfix.
+//
+// Copyright 2024 John Chadwick <john@jchw.io>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+//
+// Usage: wlcursorfix-alias-index [output]
+//
+// Scans the cursors directory of every theme in XCURSOR_PATH. Names in a
+// theme that resolve to the same file as a name from cursor-names.txt are
+// aliases of that cursor, so they get its shape. The result is written to
+// output, or to ~/.cache/wlcursorfix/aliases (under XDG_CACHE_HOME if set),
+// where the shim picks it up. Run it again after installing cursor themes.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cursor-shape-v1-client-protocol.h>
+
+// Must match wlcursorfix.c.
+struct cursor_shape_entry {
+  const char *name;
+  unsigned int shape;
+};
+
+#include "cursor-shape-table.h"
+
+#define XCURSOR_DEFAULT_PATH                                                   \
+  "~/.local/share/icons:~/.icons:/usr/share/icons:/usr/share/pixmaps"
+
+// Index file layout. Must match "Cursor name aliases" in wlcursorfix.c.
+#define ALIAS_INDEX_MAGIC "WLCFALI1"
+
+struct alias_index_header {
+  char magic[8];
+  uint32_t count;
+  uint32_t strings_size;
+};
+
+struct alias_index_entry {
+  uint32_t name;
+  uint32_t shape;
+};
+
+// A cursor name found in a theme, and the file it resolves to
+struct theme_name {
+  char *name;
+  dev_t dev;
+  ino_t ino;
+  unsigned int shape;
+};
+
+struct theme_names {
+  struct theme_name *names;
+  size_t count, capacity;
+};
+
+struct alias {
+  char *name;
+  unsigned int shape;
+  // Position in scan order
+  size_t order;
+};
+
+struct aliases {
+  struct alias *aliases;
+  size_t count, capacity;
+};
+
+static void fail(const char *message) {
+  fprintf(stderr, "wlcursorfix-alias-index: %s\n", message);
+  exit(1);
+}
+
+static void *grow(void *array, size_t *capacity, size_t element_size) {
+  *capacity = *capacity ? *capacity * 2 : 256;
+  array = realloc(array, *capacity * element_size);
+  if (!array) {
+    fail("out of memory");
+  }
+  return array;
+}
+
+// The shape of a name in the built-in table, or 0. Linear, but this runs once.
+static unsigned int known_shape(const char *name) {
+  for (size_t i = 0; i < CURSOR_SHAPE_TABLE_SIZE; i++) {
+    if (cursor_shape_table[i].name &&
+        strcmp(cursor_shape_table[i].name, name) == 0) {
+      return cursor_shape_table[i].shape;
+    }
+  }
+  return 0;
+}
+
+static int compare_file(const void *a, const void *b) {
+  const struct theme_name *left = a, *right = b;
+  if (left->dev != right->dev) {
+    return left->dev < right->dev ? -1 : 1;
+  }
+  if (left->ino != right->ino) {
+    return left->ino < right->ino ? -1 : 1;
+  }
+  // Known names first within each file
+  return (left->shape == 0) - (right->shape == 0);
+}
+
+static int compare_alias(const void *a, const void *b) {
+  const struct alias *left = a, *right = b;
+  int order = strcmp(left->name, right->name);
+  if (order != 0) {
+    return order;
+  }
+  return left->order < right->order ? -1 : left->order > right->order;
+}
+
+// Add the aliases of one theme's cursors directory.
+static void scan_theme(const char *cursors_dir, struct aliases *aliases) {
+  DIR *dir = opendir(cursors_dir);
+  if (!dir) {
+    return;
+  }
+  struct theme_names names = {0};
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    // stat follows the symlinks, so aliases end up with their target's inode.
+    struct stat st;
+    if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (names.count == names.capacity) {
+      names.names = grow(names.names, &names.capacity, sizeof(*names.names));
+    }
+    char *name = strdup(entry->d_name);
+    if (!name) {
+      fail("out of memory");
+    }
+    names.names[names.count++] = (struct theme_name){
+        name, st.st_dev, st.st_ino, known_shape(entry->d_name)};
+  }
+  closedir(dir);
+
+  qsort(names.names, names.count, sizeof(*names.names), compare_file);
+  for (size_t start = 0, end; start < names.count; start = end) {
+    // The names that resolve to the same file; known ones come first.
+    unsigned int shape = names.names[start].shape;
+    bool ambiguous = false;
+    for (end = start + 1;
+         end < names.count && names.names[end].dev == names.names[start].dev &&
+         names.names[end].ino == names.names[start].ino;
+         end++) {
+      if (names.names[end].shape && names.names[end].shape != shape) {
+        ambiguous = true;
+      }
+    }
+    for (size_t i = start; i < end; i++) {
+      if (shape && !ambiguous && !names.names[i].shape) {
+        if (aliases->count == aliases->capacity) {
+          aliases->aliases = grow(aliases->aliases, &aliases->capacity,
+                                  sizeof(*aliases->aliases));
+        }
+        aliases->aliases[aliases->count] =
+            (struct alias){names.names[i].name, shape, aliases->count};
+        aliases->count++;
+      } else {
+        free(names.names[i].name);
+      }
+    }
+  }
+  free(names.names);
+}
+
+static void scan_theme_in(const char *icon_dir, const char *theme,
+                          struct aliases *aliases) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s/cursors", icon_dir, theme) <
+      sizeof(path)) {
+    scan_theme(path, aliases);
+  }
+}
+
+// Scan the themes of an icon directory in name order, so that the result
+// doesn't depend on directory order. The preferred theme, if any, was scanned
+// already.
+static void scan_icon_dir(const char *icon_dir, const char *preferred,
+                          struct aliases *aliases) {
+  struct dirent **entries;
+  int count = scandir(icon_dir, &entries, NULL, alphasort);
+  if (count < 0) {
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    const char *theme = entries[i]->d_name;
+    if (theme[0] != '.' && (!preferred || strcmp(theme, preferred) != 0)) {
+      scan_theme_in(icon_dir, theme, aliases);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+// Call fn for each directory in the Xcursor search path.
+static void for_each_icon_dir(void (*fn)(const char *dir, const char *theme,
+                                         struct aliases *aliases),
+                              const char *theme, struct aliases *aliases) {
+  const char *path = getenv("XCURSOR_PATH");
+  if (!path || !*path) {
+    path = XCURSOR_DEFAULT_PATH;
+  }
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX];
+  while (*path) {
+    size_t length = strcspn(path, ":");
+    int written;
+    if (path[0] == '~' && home) {
+      written = snprintf(dir, sizeof(dir), "%s%.*s", home, (int)length - 1,
+                         path + 1);
+    } else {
+      written = snprintf(dir, sizeof(dir), "%.*s", (int)length, path);
+    }
+    if (length > 0 && written > 0 && written < sizeof(dir)) {
+      fn(dir, theme, aliases);
+    }
+    path += length;
+    if (*path == ':') {
+      path++;
+    }
+  }
+}
+
+// Sort by name and drop duplicates. Themes seldom disagree about an alias;
+// when they do, the one scanned first wins.
+static void sort_aliases(struct aliases *aliases) {
+  qsort(aliases->aliases, aliases->count, sizeof(*aliases->aliases),
+        compare_alias);
+  size_t kept = 0;
+  for (size_t i = 0; i < aliases->count; i++) {
+    struct alias *alias = &aliases->aliases[i];
+    if (kept > 0 && strcmp(aliases->aliases[kept - 1].name, alias->name) == 0) {
+      free(alias->name);
+      continue;
+    }
+    aliases->aliases[kept++] = *alias;
+  }
+  aliases->count = kept;
+}
+
+static bool default_output(char *path, size_t size) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int length;
+  if (cache_home && *cache_home) {
+    length = snprintf(path, size, "%s/wlcursorfix", cache_home);
+  } else if (home && *home) {
+    snprintf(path, size, "%s/.cache", home);
+    mkdir(path, 0755);
+    length = snprintf(path, size, "%s/.cache/wlcursorfix", home);
+  } else {
+    return false;
+  }
+  if (length < 0 || length >= size) {
+    return false;
+  }
+  mkdir(path, 0755);
+  return snprintf(path + length, size - length, "/aliases") < size - length;
+}
+
+// Write the index next to output and rename it into place, so that a process
+// mapping the old index never sees a half-written one.
+static void write_index(const char *output, const struct aliases *aliases) {
+  struct alias_index_header header = {.count = aliases->count};
+  memcpy(header.magic, ALIAS_INDEX_MAGIC, sizeof(header.magic));
+  for (size_t i = 0; i < aliases->count; i++) {
+    size_t length = strlen(aliases->aliases[i].name) + 1;
+    if (header.strings_size > UINT32_MAX - length) {
+      fail("too many aliases");
+    }
+    header.strings_size += length;
+  }
+
+  char temporary[PATH_MAX];
+  if (snprintf(temporary, sizeof(temporary), "%s.%d", output, (int)getpid()) >=
+      sizeof(temporary)) {
+    fail("output path too long");
+  }
+  FILE *f = fopen(temporary, "we");
+  if (!f) {
+    fprintf(stderr, "wlcursorfix-alias-index: can't write %s: %s\n",
+            temporary, strerror(errno));
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  uint32_t offset = 0;
+  for (size_t i = 0; i < aliases->count; i++) {
+    struct alias_index_entry entry = {offset, aliases->aliases[i].shape};
+    fwrite(&entry, sizeof(entry), 1, f);
+    offset += strlen(aliases->aliases[i].name) + 1;
+  }
+  for (size_t i = 0; i < aliases->count; i++) {
+    fputs(aliases->aliases[i].name, f);
+    fputc('\0', f);
+  }
+  bool failed = ferror(f);
+  if (fclose(f) != 0 || failed || rename(temporary, output) < 0) {
+    unlink(temporary);
+    fprintf(stderr, "wlcursorfix-alias-index: can't write %s: %s\n", output,
+            strerror(errno));
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    fail("usage: wlcursorfix-alias-index [output]");
+  }
+  char output[PATH_MAX];
+  if (argc == 2) {
+    snprintf(output, sizeof(output), "%s", argv[1]);
+  } else if (!default_output(output, sizeof(output))) {
+    fail("no output given, and neither XDG_CACHE_HOME nor HOME is set");
+  }
+
+  // The theme in use comes first, then every theme, directories searched in
+  // XCURSOR_PATH order, like libXcursor does.
+  struct aliases aliases = {0};
+  const char *theme = getenv("XCURSOR_THEME");
+  if (theme && *theme && !strchr(theme, '/')) {
+    for_each_icon_dir(scan_theme_in, theme, &aliases);
+  } else {
+    theme = NULL;
+  }
+  for_each_icon_dir(scan_icon_dir, theme, &aliases);
+  sort_aliases(&aliases);
+  write_index(output, &aliases);
+  printf("wrote %zu cursor aliases to %s\n", aliases.count, output);
+  return 0;
+}
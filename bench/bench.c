@@ -0,0 +1,533 @@
+// Benchmarks for the wlcursorfix hot paths.
+//
+// Copyright 2024 John Chadwick <john@jchw.io>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// The shim is compiled straight into this program, so that its hooks
+// interpose libwayland-client just like they do when preloaded, and so that
+// its internal lookups can be timed on their own. Everything runs against an
+// in-process mock compositor. Results are printed as one JSON object per line.
+#include "../wlcursorfix.c"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "mock-compositor.h"
+
+// Requests are sent in batches between flushes, so that the connection buffer
+// never fills up in the middle of a timed section.
+#define BATCH 32
+#define ROUNDTRIP_EVERY 32
+
+struct client {
+  struct wl_display *display;
+  struct wl_compositor *compositor;
+  struct wl_shm *shm;
+  struct wl_seat *seat;
+  struct wl_pointer *pointer;
+  struct wl_surface *cursor_surface;
+  // A second pointer with its own cursor surface, as a second seat or a
+  // tablet tool would have.
+  struct wl_pointer *other_pointer;
+  struct wl_surface *other_cursor_surface;
+  struct wl_surface *window_surface;
+  struct wl_region *region;
+  struct wl_shm_pool *pool;
+  struct wl_buffer *shape_buffers[2];
+  struct wl_buffer *unknown_buffer;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t iterations, uint64_t total_ns) {
+  printf("{\"benchmark\":\"%s\",\"iterations\":%" PRIu64
+         ",\"ns_per_op\":%.2f}\n",
+         name, iterations, iterations ? (double)total_ns / iterations : 0.0);
+}
+
+// Flush a batch, and every so often wait for the compositor to catch up.
+static void end_batch(struct client *client, uint64_t batch) {
+  wl_display_flush(client->display);
+  if (batch % ROUNDTRIP_EVERY == ROUNDTRIP_EVERY - 1) {
+    wl_display_roundtrip(client->display);
+  }
+}
+
+//
+// Client setup
+//
+
+static void registry_global(void *data, struct wl_registry *registry,
+                            uint32_t name, const char *interface,
+                            uint32_t version) {
+  struct client *client = data;
+  if (strcmp(interface, "wl_compositor") == 0) {
+    client->compositor =
+        wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    client->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+  } else if (strcmp(interface, "wl_seat") == 0) {
+    client->seat = wl_registry_bind(registry, name, &wl_seat_interface, 5);
+  }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry,
+                                   uint32_t name) {}
+
+static const struct wl_registry_listener client_registry_listener = {
+    registry_global,
+    registry_global_remove,
+};
+
+static bool client_setup(struct client *client, int fd) {
+  client->display = wl_display_connect_to_fd(fd);
+  if (!client->display) {
+    return false;
+  }
+  struct wl_registry *registry = wl_display_get_registry(client->display);
+  wl_registry_add_listener(registry, &client_registry_listener, client);
+  wl_display_roundtrip(client->display);
+  if (!client->compositor || !client->shm || !client->seat ||
+      !display_has_cursor_shape_manager(client->display)) {
+    return false;
+  }
+  client->pointer = wl_seat_get_pointer(client->seat);
+  client->cursor_surface = wl_compositor_create_surface(client->compositor);
+  client->other_pointer = wl_seat_get_pointer(client->seat);
+  client->other_cursor_surface =
+      wl_compositor_create_surface(client->compositor);
+  client->window_surface = wl_compositor_create_surface(client->compositor);
+  client->region = wl_compositor_create_region(client->compositor);
+
+  const int size = 32;
+  int fd_pool = memfd_create("wlcursorfix-bench", MFD_CLOEXEC);
+  if (fd_pool < 0 || ftruncate(fd_pool, size * size * 4) < 0) {
+    return false;
+  }
+  client->pool = wl_shm_create_pool(client->shm, fd_pool, size * size * 4);
+  close(fd_pool);
+  for (int i = 0; i < 2; i++) {
+    client->shape_buffers[i] = wl_shm_pool_create_buffer(
+        client->pool, 0, size, size, size * 4, WL_SHM_FORMAT_ARGB8888);
+  }
+  client->unknown_buffer = wl_shm_pool_create_buffer(
+      client->pool, 0, size, size, size * 4, WL_SHM_FORMAT_ARGB8888);
+  store_buffer_shape(client->shape_buffers[0],
+                     WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_DEFAULT);
+  store_buffer_shape(client->shape_buffers[1],
+                     WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_POINTER);
+  wl_display_roundtrip(client->display);
+  return true;
+}
+
+//
+// Request hook benchmarks
+//
+
+static void bench_passthrough(struct client *client, uint64_t iterations) {
+  struct wl_proxy *(*real_marshal)(struct wl_proxy *, uint32_t,
+                                   const struct wl_interface *, uint32_t,
+                                   uint32_t, union wl_argument *) =
+      dlsym(RTLD_NEXT, "wl_proxy_marshal_array_flags");
+  struct wl_proxy *region = (struct wl_proxy *)client->region;
+  uint32_t version = wl_proxy_get_version(region);
+  union wl_argument args[4] = {{.i = 0}, {.i = 0}, {.i = 1}, {.i = 1}};
+  uint64_t batches = iterations / BATCH;
+
+  // libwayland on its own, for reference
+  uint64_t total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      real_marshal(region, WL_REGION_ADD, NULL, version, 0, args);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  report("passthrough_baseline", batches * BATCH, total);
+
+  // Through the hook, for an interface the shim doesn't care about
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      wl_proxy_marshal_array_flags(region, WL_REGION_ADD, NULL, version, 0,
+                                   args);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  report("passthrough_other", batches * BATCH, total);
+
+  // The same, in the pass-through mode used when no display has a cursor shape
+  // manager
+  atomic_store(&marshal_impl, marshal_passthrough);
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      wl_proxy_marshal_array_flags(region, WL_REGION_ADD, NULL, version, 0,
+                                   args);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  atomic_store(&marshal_impl, marshal_hook);
+  report("passthrough_disarmed", batches * BATCH, total);
+
+  // Through the hook, for wl_surface requests on a non-cursor surface
+  struct wl_proxy *surface = (struct wl_proxy *)client->window_surface;
+  version = wl_proxy_get_version(surface);
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      wl_proxy_marshal_array_flags(surface, WL_SURFACE_DAMAGE, NULL, version,
+                                   0, args);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  report("passthrough_surface", batches * BATCH, total);
+  wl_display_roundtrip(client->display);
+}
+
+// The full set_cursor -> attach -> damage -> commit sequence an application
+// sends to change its cursor.
+static void set_cursor_sequence(struct client *client, uint32_t serial,
+                                struct wl_buffer *buffer) {
+  wl_pointer_set_cursor(client->pointer, serial, client->cursor_surface, 0, 0);
+  wl_surface_attach(client->cursor_surface, buffer, 0, 0);
+  wl_surface_damage(client->cursor_surface, 0, 0, 32, 32);
+  wl_surface_commit(client->cursor_surface);
+}
+
+static void bench_set_cursor(struct client *client,
+                             struct mock_compositor *compositor,
+                             uint64_t iterations) {
+  struct mock_compositor_stats before, after;
+  uint64_t batches = iterations / BATCH / 4;
+  uint32_t serial = 1;
+
+  mock_compositor_get_stats(compositor, &before);
+  uint64_t total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      set_cursor_sequence(client, serial++, client->shape_buffers[i & 1]);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  wl_display_roundtrip(client->display);
+  mock_compositor_get_stats(compositor, &after);
+  report("set_cursor_mapped", batches * BATCH, total);
+  printf("{\"benchmark\":\"set_cursor_mapped_wire\",\"set_shape\":%" PRIu64
+         ",\"set_cursor\":%" PRIu64 "}\n",
+         after.set_shape - before.set_shape,
+         after.set_cursor - before.set_cursor);
+
+  // Re-sending set_cursor for a surface that already shows a known shape, as
+  // toolkits do on every wl_pointer.enter.
+  mock_compositor_get_stats(compositor, &before);
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      wl_pointer_set_cursor(client->pointer, serial++, client->cursor_surface,
+                            0, 0);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  wl_display_roundtrip(client->display);
+  mock_compositor_get_stats(compositor, &after);
+  report("set_cursor_bare", batches * BATCH, total);
+  printf("{\"benchmark\":\"set_cursor_bare_wire\",\"set_shape\":%" PRIu64
+         ",\"set_cursor\":%" PRIu64 "}\n",
+         after.set_shape - before.set_shape,
+         after.set_cursor - before.set_cursor);
+
+  // Both pointers get set_cursor before either surface is attached to. Each
+  // should still end up as set_shape.
+  mock_compositor_get_stats(compositor, &before);
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i += 2) {
+      wl_pointer_set_cursor(client->pointer, serial, client->cursor_surface, 0,
+                            0);
+      wl_pointer_set_cursor(client->other_pointer, serial++,
+                            client->other_cursor_surface, 0, 0);
+      wl_surface_attach(client->cursor_surface,
+                        client->shape_buffers[(i >> 1) & 1], 0, 0);
+      wl_surface_attach(client->other_cursor_surface,
+                        client->shape_buffers[~(i >> 1) & 1], 0, 0);
+      wl_surface_commit(client->cursor_surface);
+      wl_surface_commit(client->other_cursor_surface);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  wl_display_roundtrip(client->display);
+  mock_compositor_get_stats(compositor, &after);
+  report("set_cursor_interleaved", batches * BATCH, total);
+  printf("{\"benchmark\":\"set_cursor_interleaved_wire\",\"set_shape\":%"
+         PRIu64 ",\"set_cursor\":%" PRIu64 "}\n",
+         after.set_shape - before.set_shape,
+         after.set_cursor - before.set_cursor);
+
+  // Several cursor changes for the same enter serial in each batch, as when
+  // the pointer crosses nested widgets within one dispatch, in coalescing
+  // mode. Only the last change of each batch should reach the compositor.
+  coalesce_shapes = true;
+  mock_compositor_get_stats(compositor, &before);
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      set_cursor_sequence(client, serial, client->shape_buffers[i & 1]);
+    }
+    serial++;
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  wl_display_roundtrip(client->display);
+  coalesce_shapes = false;
+  mock_compositor_get_stats(compositor, &after);
+  report("set_cursor_coalesced", batches * BATCH, total);
+  printf("{\"benchmark\":\"set_cursor_coalesced_wire\",\"set_shape\":%" PRIu64
+         ",\"set_cursor\":%" PRIu64 "}\n",
+         after.set_shape - before.set_shape,
+         after.set_cursor - before.set_cursor);
+
+  total = 0;
+  for (uint64_t batch = 0; batch < batches; batch++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      set_cursor_sequence(client, serial++, client->unknown_buffer);
+    }
+    total += now_ns() - start;
+    end_batch(client, batch);
+  }
+  wl_display_roundtrip(client->display);
+  report("set_cursor_fallback", batches * BATCH, total);
+}
+
+// Repeated wl_cursor_theme_get_cursor calls for the same cursor, as toolkits
+// that don't cache their cursors make on every motion event. This uses
+// libwayland-cursor's built-in fallback cursors if no theme is installed.
+static void bench_get_cursor(struct client *client, uint64_t iterations) {
+  struct wl_cursor_theme *theme = wl_cursor_theme_load(NULL, 24, client->shm);
+  if (!theme) {
+    return;
+  }
+  static const char *const names[] = {"left_ptr", "xterm", "hand2", "watch"};
+  volatile uintptr_t sink = 0;
+
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += (uintptr_t)real.wl_cursor_theme_get_cursor(theme, names[i & 3]);
+  }
+  report("get_cursor_baseline", iterations, now_ns() - start);
+
+  start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += (uintptr_t)wl_cursor_theme_get_cursor(theme, names[i & 3]);
+  }
+  report("get_cursor_repeat", iterations, now_ns() - start);
+
+  wl_cursor_theme_destroy(theme);
+  (void)sink;
+}
+
+//
+// Lookup benchmarks
+//
+
+#define LOOKUP_KEYS 4096
+
+static struct wl_buffer *fake_buffer(uint64_t i) {
+  return (struct wl_buffer *)(uintptr_t)(0x100000 + i * 64);
+}
+
+static void bench_lookup(uint64_t iterations) {
+  for (uint64_t i = 0; i < LOOKUP_KEYS; i++) {
+    store_buffer_shape(fake_buffer(i), WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_TEXT);
+  }
+  volatile unsigned int sink = 0;
+
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += lookup_buffer_shape(fake_buffer(i & 7));
+  }
+  report("lookup_hit_cached", iterations, now_ns() - start);
+
+  start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += lookup_buffer_shape(fake_buffer((i * 2654435761u) % LOOKUP_KEYS));
+  }
+  report("lookup_hit", iterations, now_ns() - start);
+
+  start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += lookup_buffer_shape(fake_buffer(LOOKUP_KEYS + i % LOOKUP_KEYS));
+  }
+  report("lookup_miss", iterations, now_ns() - start);
+  (void)sink;
+}
+
+// Hash a cursor-sized image, as done once for every unknown shm buffer.
+static void bench_pixel_hash(uint64_t iterations) {
+  enum { SIZE = 48 };
+  static uint32_t pixels[SIZE * SIZE];
+  for (int i = 0; i < SIZE * SIZE; i++) {
+    pixels[i] = i * 2654435761u;
+  }
+  volatile uint64_t sink = 0;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    pixels[0] = i;
+    sink += pixel_hash((const unsigned char *)pixels, SIZE, SIZE, SIZE * 4);
+  }
+  report("pixel_hash_48px", iterations, now_ns() - start);
+  (void)sink;
+}
+
+//
+// GTK theme benchmarks
+//
+
+#define GTK_CURSORS 200
+#define GTK_IMAGES_PER_CURSOR 24
+
+static struct gtk_wl_cursor_theme *fake_gtk_theme;
+
+static struct gtk_wl_cursor_theme *fake_get_cursor_theme(void *display) {
+  return fake_gtk_theme;
+}
+
+// Build a GTK-style theme whose buffers are fake pointers starting at base.
+static struct gtk_wl_cursor_theme *build_gtk_theme(uintptr_t base) {
+  struct gtk_wl_cursor_theme *theme = calloc(1, sizeof(*theme));
+  theme->cursor_count = GTK_CURSORS;
+  theme->cursors = calloc(GTK_CURSORS, sizeof(*theme->cursors));
+  // Give the first cursors names that have shapes, the rest unknown names.
+  const char *known_names[GTK_CURSORS] = {0};
+  for (int i = 0, j = 0; i < CURSOR_SHAPE_TABLE_SIZE && j < GTK_CURSORS; i++) {
+    if (cursor_shape_table[i].name) {
+      known_names[j++] = cursor_shape_table[i].name;
+    }
+  }
+  for (int i = 0; i < GTK_CURSORS; i++) {
+    struct gtk_wl_cursor *cursor = calloc(1, sizeof(*cursor));
+    char name[48];
+    if (known_names[i]) {
+      snprintf(name, sizeof(name), "%s", known_names[i]);
+    } else {
+      snprintf(name, sizeof(name), "unknown-%d", i);
+    }
+    cursor->name = strdup(name);
+    cursor->image_count = GTK_IMAGES_PER_CURSOR;
+    cursor->images = calloc(GTK_IMAGES_PER_CURSOR, sizeof(*cursor->images));
+    for (int j = 0; j < GTK_IMAGES_PER_CURSOR; j++) {
+      struct gtk_cursor_image *image = calloc(1, sizeof(*image));
+      image->theme = theme;
+      image->buffer =
+          (struct wl_buffer *)(base + (i * GTK_IMAGES_PER_CURSOR + j) * 64);
+      cursor->images[j] = image;
+    }
+    theme->cursors[i] = cursor;
+  }
+  return theme;
+}
+
+static struct wl_buffer *gtk_image_buffer(struct gtk_wl_cursor_theme *theme,
+                                          uint64_t i) {
+  struct gtk_wl_cursor *cursor = theme->cursors[i % GTK_CURSORS];
+  return cursor->images[(i / GTK_CURSORS) % GTK_IMAGES_PER_CURSOR]->buffer;
+}
+
+static void bench_gtk_theme(uint64_t iterations) {
+  static int display;
+  struct gtk_wl_cursor_theme *themes[2] = {
+      build_gtk_theme(0x40000000),
+      build_gtk_theme(0x50000000),
+  };
+  mtx_init(&gtk_theme_index.lock, mtx_plain);
+  _gdk_wayland_display_get_cursor_theme = fake_get_cursor_theme;
+  volatile unsigned int sink = 0;
+
+  // Full index builds, alternating between two themes as if the scale
+  // changed back and forth.
+  uint64_t rebuilds = iterations / 1000 + 1;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < rebuilds; i++) {
+    fake_gtk_theme = themes[i & 1];
+    sink += gdk_wayland_display_cursor_buffer_shape(
+        &display, gtk_image_buffer(fake_gtk_theme, i));
+  }
+  report("gtk_theme_index_build", rebuilds, now_ns() - start);
+  printf("{\"benchmark\":\"gtk_theme_images\",\"images\":%d}\n",
+         GTK_CURSORS * GTK_IMAGES_PER_CURSOR);
+
+  fake_gtk_theme = themes[0];
+  start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += gdk_wayland_display_cursor_buffer_shape(
+        &display, gtk_image_buffer(fake_gtk_theme, i * 7919));
+  }
+  report("gtk_theme_hit", iterations, now_ns() - start);
+
+  start = now_ns();
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += gdk_wayland_display_cursor_buffer_shape(
+        &display, fake_buffer(LOOKUP_KEYS * 2 + i % 64));
+  }
+  report("gtk_theme_miss", iterations, now_ns() - start);
+  (void)sink;
+}
+
+int main(int argc, char **argv) {
+  uint64_t iterations = 200000;
+  if (argc > 1) {
+    iterations = strtoull(argv[1], NULL, 10);
+  }
+
+  struct mock_compositor *compositor = mock_compositor_start();
+  if (!compositor) {
+    fprintf(stderr, "failed to start mock compositor\n");
+    return 1;
+  }
+  struct client client = {0};
+  if (!client_setup(&client, mock_compositor_take_client_fd(compositor))) {
+    fprintf(stderr, "failed to set up client\n");
+    return 1;
+  }
+
+  bench_passthrough(&client, iterations);
+  bench_set_cursor(&client, compositor, iterations);
+  bench_get_cursor(&client, iterations);
+  bench_lookup(iterations);
+  bench_pixel_hash(iterations);
+  bench_gtk_theme(iterations);
+
+  wl_display_disconnect(client.display);
+  mock_compositor_stop(compositor);
+  return 0;
+}
@@ -0,0 +1,331 @@
+// In-process stand-in compositor for the wlcursorfix benchmarks.
+//
+// Copyright 2024 John Chadwick <john@jchw.io>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include <cursor-shape-v1-server-protocol.h>
+#include <wayland-server.h>
+
+#include "mock-compositor.h"
+
+struct mock_compositor {
+  struct wl_display *display;
+  thrd_t thread;
+  int client_fd;
+  _Atomic uint64_t set_cursor;
+  _Atomic uint64_t set_shape;
+  _Atomic uint64_t attach;
+  _Atomic uint64_t commit;
+};
+
+#define COUNT(resource, field)                                                 \
+  atomic_fetch_add_explicit(                                                   \
+      &((struct mock_compositor *)wl_resource_get_user_data(resource))->field, \
+      1, memory_order_relaxed)
+
+static void destroy_resource(struct wl_client *client,
+                             struct wl_resource *resource) {
+  wl_resource_destroy(resource);
+}
+
+//
+// wl_buffer, wl_shm_pool, wl_shm
+//
+
+static const struct wl_buffer_interface buffer_impl = {
+    .destroy = destroy_resource,
+};
+
+static void pool_create_buffer(struct wl_client *client,
+                               struct wl_resource *resource, uint32_t id,
+                               int32_t offset, int32_t width, int32_t height,
+                               int32_t stride, uint32_t format) {
+  struct wl_resource *buffer =
+      wl_resource_create(client, &wl_buffer_interface, 1, id);
+  wl_resource_set_implementation(buffer, &buffer_impl, NULL, NULL);
+}
+
+static void pool_resize(struct wl_client *client, struct wl_resource *resource,
+                        int32_t size) {}
+
+static const struct wl_shm_pool_interface pool_impl = {
+    .create_buffer = pool_create_buffer,
+    .destroy = destroy_resource,
+    .resize = pool_resize,
+};
+
+static void shm_create_pool(struct wl_client *client,
+                            struct wl_resource *resource, uint32_t id,
+                            int32_t fd, int32_t size) {
+  close(fd);
+  struct wl_resource *pool = wl_resource_create(
+      client, &wl_shm_pool_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(pool, &pool_impl, NULL, NULL);
+}
+
+static const struct wl_shm_interface shm_impl = {
+    .create_pool = shm_create_pool,
+};
+
+static void bind_shm(struct wl_client *client, void *data, uint32_t version,
+                     uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &wl_shm_interface, version, id);
+  wl_resource_set_implementation(resource, &shm_impl, data, NULL);
+  wl_shm_send_format(resource, WL_SHM_FORMAT_ARGB8888);
+  wl_shm_send_format(resource, WL_SHM_FORMAT_XRGB8888);
+}
+
+//
+// wl_surface, wl_region, wl_compositor
+//
+
+static void surface_attach(struct wl_client *client,
+                           struct wl_resource *resource,
+                           struct wl_resource *buffer, int32_t x, int32_t y) {
+  COUNT(resource, attach);
+}
+
+static void surface_rect(struct wl_client *client, struct wl_resource *resource,
+                         int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void surface_frame(struct wl_client *client,
+                          struct wl_resource *resource, uint32_t id) {
+  // Nothing is ever displayed, so just fire the callback right away.
+  struct wl_resource *callback =
+      wl_resource_create(client, &wl_callback_interface, 1, id);
+  wl_callback_send_done(callback, 0);
+  wl_resource_destroy(callback);
+}
+
+static void surface_set_region(struct wl_client *client,
+                               struct wl_resource *resource,
+                               struct wl_resource *region) {}
+
+static void surface_commit(struct wl_client *client,
+                           struct wl_resource *resource) {
+  COUNT(resource, commit);
+}
+
+static void surface_set_int(struct wl_client *client,
+                            struct wl_resource *resource, int32_t value) {}
+
+static const struct wl_surface_interface surface_impl = {
+    .destroy = destroy_resource,
+    .attach = surface_attach,
+    .damage = surface_rect,
+    .frame = surface_frame,
+    .set_opaque_region = surface_set_region,
+    .set_input_region = surface_set_region,
+    .commit = surface_commit,
+    .set_buffer_transform = surface_set_int,
+    .set_buffer_scale = surface_set_int,
+    .damage_buffer = surface_rect,
+};
+
+static const struct wl_region_interface region_impl = {
+    .destroy = destroy_resource,
+    .add = surface_rect,
+    .subtract = surface_rect,
+};
+
+static void compositor_create_surface(struct wl_client *client,
+                                      struct wl_resource *resource,
+                                      uint32_t id) {
+  struct wl_resource *surface = wl_resource_create(
+      client, &wl_surface_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(surface, &surface_impl,
+                                 wl_resource_get_user_data(resource), NULL);
+}
+
+static void compositor_create_region(struct wl_client *client,
+                                     struct wl_resource *resource,
+                                     uint32_t id) {
+  struct wl_resource *region =
+      wl_resource_create(client, &wl_region_interface, 1, id);
+  wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+    .create_surface = compositor_create_surface,
+    .create_region = compositor_create_region,
+};
+
+static void bind_compositor(struct wl_client *client, void *data,
+                            uint32_t version, uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &wl_compositor_interface, version, id);
+  wl_resource_set_implementation(resource, &compositor_impl, data, NULL);
+}
+
+//
+// wl_pointer, wl_seat
+//
+
+static void pointer_set_cursor(struct wl_client *client,
+                               struct wl_resource *resource, uint32_t serial,
+                               struct wl_resource *surface, int32_t hotspot_x,
+                               int32_t hotspot_y) {
+  COUNT(resource, set_cursor);
+}
+
+static const struct wl_pointer_interface pointer_impl = {
+    .set_cursor = pointer_set_cursor,
+    .release = destroy_resource,
+};
+
+static void seat_get_pointer(struct wl_client *client,
+                             struct wl_resource *resource, uint32_t id) {
+  struct wl_resource *pointer = wl_resource_create(
+      client, &wl_pointer_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(pointer, &pointer_impl,
+                                 wl_resource_get_user_data(resource), NULL);
+}
+
+static void seat_get_unsupported(struct wl_client *client,
+                                 struct wl_resource *resource, uint32_t id) {
+  wl_client_post_no_memory(client);
+}
+
+static const struct wl_seat_interface seat_impl = {
+    .get_pointer = seat_get_pointer,
+    .get_keyboard = seat_get_unsupported,
+    .get_touch = seat_get_unsupported,
+    .release = destroy_resource,
+};
+
+static void bind_seat(struct wl_client *client, void *data, uint32_t version,
+                      uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &wl_seat_interface, version, id);
+  wl_resource_set_implementation(resource, &seat_impl, data, NULL);
+  wl_seat_send_capabilities(resource, WL_SEAT_CAPABILITY_POINTER);
+  if (version >= WL_SEAT_NAME_SINCE_VERSION) {
+    wl_seat_send_name(resource, "seat0");
+  }
+}
+
+//
+// wp_cursor_shape_device_v1, wp_cursor_shape_manager_v1
+//
+
+static void device_set_shape(struct wl_client *client,
+                             struct wl_resource *resource, uint32_t serial,
+                             uint32_t shape) {
+  COUNT(resource, set_shape);
+}
+
+static const struct wp_cursor_shape_device_v1_interface device_impl = {
+    .destroy = destroy_resource,
+    .set_shape = device_set_shape,
+};
+
+static void manager_get_device(struct wl_client *client,
+                               struct wl_resource *resource, uint32_t id,
+                               struct wl_resource *object) {
+  struct wl_resource *device = wl_resource_create(
+      client, &wp_cursor_shape_device_v1_interface, 1, id);
+  wl_resource_set_implementation(device, &device_impl,
+                                 wl_resource_get_user_data(resource), NULL);
+}
+
+static const struct wp_cursor_shape_manager_v1_interface manager_impl = {
+    .destroy = destroy_resource,
+    .get_pointer = manager_get_device,
+    .get_tablet_tool_v2 = manager_get_device,
+};
+
+static void bind_manager(struct wl_client *client, void *data,
+                         uint32_t version, uint32_t id) {
+  struct wl_resource *resource = wl_resource_create(
+      client, &wp_cursor_shape_manager_v1_interface, version, id);
+  wl_resource_set_implementation(resource, &manager_impl, data, NULL);
+}
+
+//
+// Lifecycle
+//
+
+static int run(void *data) {
+  struct mock_compositor *compositor = data;
+  wl_display_run(compositor->display);
+  return 0;
+}
+
+struct mock_compositor *mock_compositor_start(void) {
+  struct mock_compositor *compositor = calloc(1, sizeof(*compositor));
+  if (!compositor) {
+    return NULL;
+  }
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    free(compositor);
+    return NULL;
+  }
+  compositor->display = wl_display_create();
+  if (!compositor->display) {
+    close(fds[0]);
+    close(fds[1]);
+    free(compositor);
+    return NULL;
+  }
+  wl_global_create(compositor->display, &wl_compositor_interface, 4,
+                   compositor, bind_compositor);
+  wl_global_create(compositor->display, &wl_shm_interface, 1, compositor,
+                   bind_shm);
+  wl_global_create(compositor->display, &wl_seat_interface, 5, compositor,
+                   bind_seat);
+  wl_global_create(compositor->display, &wp_cursor_shape_manager_v1_interface,
+                   1, compositor, bind_manager);
+  wl_client_create(compositor->display, fds[0]);
+  compositor->client_fd = fds[1];
+  if (thrd_create(&compositor->thread, run, compositor) != thrd_success) {
+    wl_display_destroy(compositor->display);
+    close(fds[1]);
+    free(compositor);
+    return NULL;
+  }
+  return compositor;
+}
+
+int mock_compositor_take_client_fd(struct mock_compositor *compositor) {
+  int fd = compositor->client_fd;
+  compositor->client_fd = -1;
+  return fd;
+}
+
+void mock_compositor_get_stats(struct mock_compositor *compositor,
+                               struct mock_compositor_stats *stats) {
+  stats->set_cursor = atomic_load(&compositor->set_cursor);
+  stats->set_shape = atomic_load(&compositor->set_shape);
+  stats->attach = atomic_load(&compositor->attach);
+  stats->commit = atomic_load(&compositor->commit);
+}
+
+void mock_compositor_stop(struct mock_compositor *compositor) {
+  wl_display_terminate(compositor->display);
+  thrd_join(compositor->thread, NULL);
+  wl_display_destroy(compositor->display);
+  if (compositor->client_fd >= 0) {
+    close(compositor->client_fd);
+  }
+  free(compositor);
+}
@@ -0,0 +1,45 @@
+// In-process stand-in compositor for the wlcursorfix benchmarks.
+//
+// Copyright 2024 John Chadwick <john@jchw.io>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef MOCK_COMPOSITOR_H
+#define MOCK_COMPOSITOR_H
+
+#include <stdint.h>
+
+// A minimal compositor running on its own thread, advertising wl_compositor,
+// wl_shm, wl_seat (with a pointer) and wp_cursor_shape_manager_v1. It does
+// nothing with the requests it gets beyond counting the interesting ones.
+struct mock_compositor;
+
+struct mock_compositor_stats {
+  uint64_t set_cursor;
+  uint64_t set_shape;
+  uint64_t attach;
+  uint64_t commit;
+};
+
+// Start the compositor. Returns NULL on failure.
+struct mock_compositor *mock_compositor_start(void);
+
+// File descriptor to pass to wl_display_connect_to_fd. Can only be taken once.
+int mock_compositor_take_client_fd(struct mock_compositor *compositor);
+
+void mock_compositor_get_stats(struct mock_compositor *compositor,
+                               struct mock_compositor_stats *stats);
+
+void mock_compositor_stop(struct mock_compositor *compositor);
+
+#endif
@@ -0,0 +1,527 @@
+// Replays a request trace recorded with WLCURSORFIX_CAPTURE through the hook.
+//
+// Copyright 2024 John Chadwick <john@jchw.io>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Usage: wlcursorfix-replay TRACE [--max-p99-overhead-ns N]
+//                                 [--min-hit-rate FRACTION]
+//
+// The trace is replayed twice against the mock compositor: once straight into
+// libwayland, and once through the hook. Each request is timed on its own, and
+// the difference between the two runs' percentiles is the hook's overhead.
+// Objects in the trace are stood in for by objects of the same interface where
+// the mock compositor has them (surfaces, pointers, shm pools and buffers);
+// requests to anything else become wl_region.add, which costs the hook the
+// same as any request it doesn't care about. Attached buffers are given the
+// shape they mapped to when the trace was recorded, so the hit rate reflects
+// the deferral logic rather than the theme lookups, which can't be replayed.
+//
+// With thresholds given, the exit status is 1 if the p99 overhead or the hit
+// rate is off, so that this can gate CI.
+#include "../wlcursorfix.c"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "mock-compositor.h"
+
+#define FLUSH_EVERY 32
+#define ROUNDTRIP_EVERY 1024
+// Size of the pools standing in for pools we don't know the size of
+#define STAND_IN_POOL_SIZE (32 * 32 * 4)
+
+struct trace {
+  const struct capture_header *header;
+  size_t size;
+  // Records in the order they were written
+  uint64_t first;
+  uint64_t count;
+  // Our proxy class for each class in the trace
+  enum proxy_class classes[CAPTURE_MAX_CLASSES];
+};
+
+struct client {
+  struct wl_display *display;
+  struct wl_compositor *compositor;
+  struct wl_shm *shm;
+  struct wl_seat *seat;
+  struct wl_region *region;
+  struct wl_shm_pool *pool;
+};
+
+struct sample {
+  uint64_t ns;
+  enum proxy_class class;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+// Trace loading
+//
+
+static const struct capture_record *trace_record(const struct trace *trace,
+                                                 uint64_t i) {
+  const struct capture_record *records =
+      (const struct capture_record *)(trace->header + 1);
+  return &records[(trace->first + i) % trace->header->capacity];
+}
+
+static bool trace_open(struct trace *trace, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct capture_header)) {
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    return false;
+  }
+  const struct capture_header *header = mapping;
+  if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != CAPTURE_VERSION ||
+      header->record_size != sizeof(struct capture_record) ||
+      header->capacity == 0 ||
+      st.st_size < sizeof(*header) +
+                       header->capacity * sizeof(struct capture_record)) {
+    fprintf(stderr, "%s: not a version %d capture file\n", path,
+            CAPTURE_VERSION);
+    return false;
+  }
+  trace->header = header;
+  trace->size = st.st_size;
+  uint64_t head = atomic_load(&header->head);
+  trace->count = head < header->capacity ? head : header->capacity;
+  trace->first = head - trace->count;
+  for (int i = 0; i < CAPTURE_MAX_CLASSES; i++) {
+    trace->classes[i] = PROXY_CLASS_OTHER;
+    char name[CAPTURE_CLASS_NAME_SIZE + 1] = {0};
+    memcpy(name, header->class_names[i], CAPTURE_CLASS_NAME_SIZE);
+    for (int j = 0; j < sizeof(proxy_class_list) / sizeof(*proxy_class_list);
+         j++) {
+      if (strcmp(name, proxy_class_list[j].name) == 0) {
+        trace->classes[i] = proxy_class_list[j].class;
+      }
+    }
+  }
+  return true;
+}
+
+//
+// Client setup
+//
+
+static void registry_global(void *data, struct wl_registry *registry,
+                            uint32_t name, const char *interface,
+                            uint32_t version) {
+  struct client *client = data;
+  if (strcmp(interface, "wl_compositor") == 0) {
+    client->compositor =
+        wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    client->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+  } else if (strcmp(interface, "wl_seat") == 0) {
+    client->seat = wl_registry_bind(registry, name, &wl_seat_interface, 5);
+  }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry,
+                                   uint32_t name) {}
+
+static const struct wl_registry_listener client_registry_listener = {
+    registry_global,
+    registry_global_remove,
+};
+
+static struct wl_shm_pool *create_pool(struct client *client, int32_t size) {
+  int fd = memfd_create("wlcursorfix-replay", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    return NULL;
+  }
+  struct wl_shm_pool *pool = wl_shm_create_pool(client->shm, fd, size);
+  close(fd);
+  return pool;
+}
+
+static bool client_setup(struct client *client, int fd) {
+  client->display = wl_display_connect_to_fd(fd);
+  if (!client->display) {
+    return false;
+  }
+  struct wl_registry *registry = wl_display_get_registry(client->display);
+  wl_registry_add_listener(registry, &client_registry_listener, client);
+  wl_display_roundtrip(client->display);
+  if (!client->compositor || !client->shm || !client->seat ||
+      !display_has_cursor_shape_manager(client->display)) {
+    return false;
+  }
+  client->region = wl_compositor_create_region(client->compositor);
+  client->pool = create_pool(client, STAND_IN_POOL_SIZE);
+  wl_display_roundtrip(client->display);
+  return client->pool != NULL;
+}
+
+//
+// Replay
+//
+
+// Make an object of the given class to stand in for one from the trace.
+static struct wl_proxy *create_stand_in(struct client *client,
+                                        enum proxy_class class) {
+  switch (class) {
+  case PROXY_CLASS_WL_SURFACE:
+    return (struct wl_proxy *)wl_compositor_create_surface(client->compositor);
+  case PROXY_CLASS_WL_POINTER:
+  case PROXY_CLASS_ZWP_TABLET_TOOL_V2:
+    return (struct wl_proxy *)wl_seat_get_pointer(client->seat);
+  case PROXY_CLASS_WL_BUFFER:
+    return (struct wl_proxy *)wl_shm_pool_create_buffer(
+        client->pool, 0, 32, 32, 32 * 4, WL_SHM_FORMAT_ARGB8888);
+  case PROXY_CLASS_WL_SHM_POOL:
+    return (struct wl_proxy *)create_pool(client, STAND_IN_POOL_SIZE);
+  case PROXY_CLASS_WL_SHM:
+    return (struct wl_proxy *)client->shm;
+  case PROXY_CLASS_WL_SEAT:
+    return (struct wl_proxy *)client->seat;
+  default:
+    return NULL;
+  }
+}
+
+// Whether requests of a class from the trace are replayed as they are. The
+// mock compositor only has a few interfaces, and only supports get_pointer on
+// the seat.
+static bool replays_as_is(enum proxy_class class, uint32_t opcode) {
+  switch (class) {
+  case PROXY_CLASS_WL_SURFACE:
+  case PROXY_CLASS_WL_POINTER:
+  case PROXY_CLASS_ZWP_TABLET_TOOL_V2:
+  case PROXY_CLASS_WL_BUFFER:
+  case PROXY_CLASS_WL_SHM_POOL:
+    return true;
+  case PROXY_CLASS_WL_SHM:
+    return opcode == WL_SHM_CREATE_POOL;
+  case PROXY_CLASS_WL_SEAT:
+    return opcode == WL_SEAT_GET_POINTER;
+  default:
+    return false;
+  }
+}
+
+static struct wl_proxy *lookup_object(struct client *client,
+                                      struct ptr_map *objects, uint32_t id,
+                                      enum proxy_class class) {
+  if (id == 0) {
+    return NULL;
+  }
+  struct wl_proxy *proxy = (struct wl_proxy *)ptr_map_lookup(
+      objects, (const void *)(uintptr_t)id);
+  if (!proxy) {
+    proxy = create_stand_in(client, class);
+    if (proxy) {
+      ptr_map_insert(objects, (const void *)(uintptr_t)id, (uintptr_t)proxy);
+    }
+  }
+  return proxy;
+}
+
+// Build the arguments of a request from its record. Returns false if the
+// request can't be replayed as it is.
+static bool replay_args(struct client *client, struct ptr_map *objects,
+                        const struct capture_record *record,
+                        struct wl_proxy *proxy, union wl_argument *args,
+                        const struct wl_interface **new_interface, int *fd) {
+  const struct wl_interface *interface = proxy->object.interface;
+  if (record->opcode >= interface->method_count) {
+    return false;
+  }
+  const struct wl_message *message = &interface->methods[record->opcode];
+  const char *signature = message->signature;
+  if (atoi(signature) > (int)wl_proxy_get_version(proxy)) {
+    return false;
+  }
+  unsigned int arg = 0;
+  for (; *signature; signature++) {
+    if (arg == CAPTURE_MAX_ARGS) {
+      return false;
+    }
+    const struct wl_interface *type = message->types[arg];
+    switch (*signature) {
+    case 'o':
+      args[arg].o = (struct wl_object *)lookup_object(
+          client, objects, record->args[arg],
+          type ? interface_class_by_name(type) : PROXY_CLASS_OTHER);
+      if (record->args[arg] && !args[arg].o) {
+        if (!type || strcmp(type->name, "wl_region") != 0) {
+          return false;
+        }
+        args[arg].o = (struct wl_object *)client->region;
+      }
+      break;
+    case 'n':
+      args[arg].n = 0;
+      *new_interface = type;
+      break;
+    case 'h':
+      // Only wl_shm.create_pool takes a file descriptor; its size follows.
+      *fd = memfd_create("wlcursorfix-replay", MFD_CLOEXEC);
+      if (*fd < 0 || ftruncate(*fd, (int32_t)record->args[arg + 1]) < 0) {
+        return false;
+      }
+      args[arg].h = *fd;
+      break;
+    case 'i':
+    case 'u':
+    case 'f':
+      args[arg].u = record->args[arg];
+      break;
+    case 's':
+    case 'a':
+      return false;
+    default:
+      continue;
+    }
+    arg++;
+  }
+  return true;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = ((const struct sample *)a)->ns;
+  uint64_t y = ((const struct sample *)b)->ns;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct sample *samples, uint64_t count,
+                           double fraction) {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t i = (uint64_t)(fraction * (count - 1) + 0.5);
+  return samples[i].ns;
+}
+
+static void report(const char *name, const char *class,
+                   const struct sample *samples, uint64_t count) {
+  printf("{\"benchmark\":\"%s\"", name);
+  if (class) {
+    printf(",\"class\":\"%s\"", class);
+  }
+  printf(",\"requests\":%" PRIu64 ",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64
+         ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64
+         "}\n",
+         count, percentile(samples, count, 0.5),
+         percentile(samples, count, 0.9), percentile(samples, count, 0.99),
+         percentile(samples, count, 0.999),
+         count ? samples[count - 1].ns : 0);
+}
+
+// Replay the whole trace, through the hook or straight into libwayland, and
+// leave the time each request took in samples, sorted.
+static void replay(struct client *client, const struct trace *trace,
+                   bool hook, struct sample *samples) {
+  marshal_array_flags_fn marshal =
+      hook ? wl_proxy_marshal_array_flags : real.wl_proxy_marshal_array_flags;
+  struct ptr_map objects = PTR_MAP_INIT;
+  for (uint64_t i = 0; i < trace->count; i++) {
+    const struct capture_record *record = trace_record(trace, i);
+    enum proxy_class class = record->class < CAPTURE_MAX_CLASSES
+                                 ? trace->classes[record->class]
+                                 : PROXY_CLASS_OTHER;
+    union wl_argument args[CAPTURE_MAX_ARGS] = {0};
+    const struct wl_interface *new_interface = NULL;
+    int fd = -1;
+    uint32_t flags = record->flags & WL_MARSHAL_FLAG_DESTROY;
+    struct wl_proxy *proxy = NULL;
+    if (replays_as_is(class, record->opcode)) {
+      proxy = lookup_object(client, &objects, record->object, class);
+    }
+    uint32_t opcode = record->opcode;
+    if (!proxy || !replay_args(client, &objects, record, proxy, args,
+                               &new_interface, &fd)) {
+      // Stand in with a request the hook passes on untouched.
+      proxy = (struct wl_proxy *)client->region;
+      opcode = WL_REGION_ADD;
+      flags = 0;
+      new_interface = NULL;
+      memset(args, 0, sizeof(args));
+    }
+    if (class == PROXY_CLASS_WL_SURFACE && opcode == WL_SURFACE_ATTACH &&
+        args[0].o && record->shape != 0) {
+      store_buffer_shape((struct wl_buffer *)args[0].o,
+                         record->shape == CAPTURE_SHAPE_NONE ? SHAPE_NONE
+                                                             : record->shape);
+    }
+    uint32_t version = wl_proxy_get_version(proxy);
+    uint64_t start = now_ns();
+    struct wl_proxy *result =
+        marshal(proxy, opcode, new_interface, version, flags, args);
+    samples[i].ns = now_ns() - start;
+    samples[i].class = class;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (flags & WL_MARSHAL_FLAG_DESTROY) {
+      ptr_map_remove(&objects, (const void *)(uintptr_t)record->object);
+    }
+    if (result && record->new_object) {
+      ptr_map_insert(&objects, (const void *)(uintptr_t)record->new_object,
+                     (uintptr_t)result);
+    }
+    if (i % FLUSH_EVERY == FLUSH_EVERY - 1) {
+      wl_display_flush(client->display);
+    }
+    if (i % ROUNDTRIP_EVERY == ROUNDTRIP_EVERY - 1) {
+      wl_display_roundtrip(client->display);
+    }
+  }
+  wl_display_roundtrip(client->display);
+  ptr_map_clear(&objects);
+}
+
+static const char *class_name(enum proxy_class class) {
+  for (int i = 0; i < sizeof(proxy_class_list) / sizeof(*proxy_class_list);
+       i++) {
+    if (proxy_class_list[i].class == class) {
+      return proxy_class_list[i].name;
+    }
+  }
+  return "other";
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  double max_p99_overhead_ns = -1;
+  double min_hit_rate = -1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--max-p99-overhead-ns") == 0 && i + 1 < argc) {
+      max_p99_overhead_ns = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--min-hit-rate") == 0 && i + 1 < argc) {
+      min_hit_rate = strtod(argv[++i], NULL);
+    } else if (!path) {
+      path = argv[i];
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+  if (!path) {
+    fprintf(stderr,
+            "usage: %s TRACE [--max-p99-overhead-ns N] "
+            "[--min-hit-rate FRACTION]\n",
+            argv[0]);
+    return 2;
+  }
+
+  struct trace trace;
+  if (!trace_open(&trace, path)) {
+    return 2;
+  }
+  struct mock_compositor *compositor = mock_compositor_start();
+  if (!compositor) {
+    fprintf(stderr, "failed to start mock compositor\n");
+    return 2;
+  }
+  struct client client = {0};
+  if (!client_setup(&client, mock_compositor_take_client_fd(compositor))) {
+    fprintf(stderr, "failed to set up client\n");
+    return 2;
+  }
+  struct sample *baseline = calloc(trace.count, sizeof(*baseline));
+  struct sample *hooked = calloc(trace.count, sizeof(*hooked));
+  if (trace.count && (!baseline || !hooked)) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  replay(&client, &trace, false, baseline);
+  struct mock_compositor_stats before, after;
+  mock_compositor_get_stats(compositor, &before);
+  replay(&client, &trace, true, hooked);
+  mock_compositor_get_stats(compositor, &after);
+
+  // Per class first, while the samples are still in trace order
+  bool present[PROXY_CLASS_COUNT] = {false};
+  for (uint64_t i = 0; i < trace.count; i++) {
+    present[hooked[i].class] = true;
+  }
+  struct sample *scratch = calloc(trace.count ? trace.count : 1,
+                                  sizeof(*scratch));
+  for (int class = 0; class < PROXY_CLASS_COUNT && scratch; class++) {
+    if (!present[class]) {
+      continue;
+    }
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < trace.count; i++) {
+      if (hooked[i].class == class) {
+        scratch[count++] = hooked[i];
+      }
+    }
+    qsort(scratch, count, sizeof(*scratch), compare_samples);
+    report("replay_hook", class_name(class), scratch, count);
+  }
+  free(scratch);
+
+  qsort(baseline, trace.count, sizeof(*baseline), compare_samples);
+  qsort(hooked, trace.count, sizeof(*hooked), compare_samples);
+  report("replay_baseline", NULL, baseline, trace.count);
+  report("replay_hook", NULL, hooked, trace.count);
+
+  double overhead[4];
+  const double fractions[4] = {0.5, 0.9, 0.99, 0.999};
+  for (int i = 0; i < 4; i++) {
+    overhead[i] = (double)percentile(hooked, trace.count, fractions[i]) -
+                  (double)percentile(baseline, trace.count, fractions[i]);
+  }
+  uint64_t set_shape = after.set_shape - before.set_shape;
+  uint64_t set_cursor = after.set_cursor - before.set_cursor;
+  double hit_rate = set_shape + set_cursor
+                        ? (double)set_shape / (set_shape + set_cursor)
+                        : 1.0;
+  printf("{\"benchmark\":\"replay_overhead\",\"p50_ns\":%.0f,\"p90_ns\":%.0f,"
+         "\"p99_ns\":%.0f,\"p999_ns\":%.0f}\n",
+         overhead[0], overhead[1], overhead[2], overhead[3]);
+  printf("{\"benchmark\":\"replay_wire\",\"set_shape\":%" PRIu64
+         ",\"set_cursor\":%" PRIu64 ",\"hit_rate\":%.4f}\n",
+         set_shape, set_cursor, hit_rate);
+
+  int status = 0;
+  if (max_p99_overhead_ns >= 0 && overhead[2] > max_p99_overhead_ns) {
+    fprintf(stderr, "p99 overhead %.0f ns is over the limit of %.0f ns\n",
+            overhead[2], max_p99_overhead_ns);
+    status = 1;
+  }
+  if (min_hit_rate >= 0 && hit_rate < min_hit_rate) {
+    fprintf(stderr, "hit rate %.4f is under the limit of %.4f\n", hit_rate,
+            min_hit_rate);
+    status = 1;
+  }
+
+  free(baseline);
+  free(hooked);
+  munmap((void *)trace.header, trace.size);
+  wl_display_disconnect(client.display);
+  mock_compositor_stop(compositor);
+  return status;
+}
@@ -0,0 +1,143 @@
+// Startup cost of preloading wlcursorfix into processes that don't use it.
+//
+// Copyright 2024 John Chadwick <john@jchw.io>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// With a session-wide LD_PRELOAD, every shell command and compiler run loads
+// the shim. This runs a trivial program many times with and without it, in
+// alternating rounds so that both see the same system noise, and reports the
+// mean and median time per run as JSON lines like the other benchmarks.
+//
+// Usage: wlcursorfix-startup SHIM.so [RUNS] [PROGRAM]
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define ROUNDS 10
+
+extern char **environ;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The environment without LD_PRELOAD, plus preload if it isn't NULL.
+static char **make_environment(const char *preload) {
+  size_t count = 0;
+  while (environ[count]) {
+    count++;
+  }
+  char **env = calloc(count + 2, sizeof(*env));
+  if (!env) {
+    return NULL;
+  }
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(environ[i], "LD_PRELOAD=", 11) != 0) {
+      env[used++] = environ[i];
+    }
+  }
+  if (preload) {
+    if (asprintf(&env[used++], "LD_PRELOAD=%s", preload) < 0) {
+      free(env);
+      return NULL;
+    }
+  }
+  return env;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Run program once and return how long it took, or 0 if it failed.
+static uint64_t run_once(const char *program, char **env) {
+  char *argv[] = {(char *)program, NULL};
+  uint64_t start = now_ns();
+  pid_t pid;
+  if (posix_spawn(&pid, program, NULL, NULL, argv, env) != 0) {
+    return 0;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return 0;
+  }
+  return now_ns() - start;
+}
+
+static void report(const char *name, uint64_t *samples, uint64_t runs) {
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < runs; i++) {
+    total += samples[i];
+  }
+  qsort(samples, runs, sizeof(*samples), compare_u64);
+  printf("{\"benchmark\":\"%s\",\"iterations\":%" PRIu64
+         ",\"ns_per_op\":%.2f,\"median_ns\":%" PRIu64 "}\n",
+         name, runs, runs ? (double)total / runs : 0.0,
+         runs ? samples[runs / 2] : 0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s SHIM.so [RUNS] [PROGRAM]\n", argv[0]);
+    return 2;
+  }
+  const char *shim = argv[1];
+  uint64_t runs = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000;
+  const char *program = argc > 3 ? argv[3] : "/bin/true";
+  runs -= runs % ROUNDS;
+  if (runs == 0) {
+    runs = ROUNDS;
+  }
+
+  char **plain_env = make_environment(NULL);
+  char **shim_env = make_environment(shim);
+  uint64_t *plain = calloc(runs, sizeof(*plain));
+  uint64_t *preloaded = calloc(runs, sizeof(*preloaded));
+  if (!plain_env || !shim_env || !plain || !preloaded) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  uint64_t per_round = runs / ROUNDS;
+  for (uint64_t round = 0; round < ROUNDS; round++) {
+    for (uint64_t i = 0; i < per_round; i++) {
+      uint64_t index = round * per_round + i;
+      plain[index] = run_once(program, plain_env);
+      preloaded[index] = run_once(program, shim_env);
+      if (!plain[index] || !preloaded[index]) {
+        fprintf(stderr, "failed to run %s\n", program);
+        return 1;
+      }
+    }
+  }
+
+  report("startup_baseline", plain, runs);
+  report("startup_preloaded", preloaded, runs);
+  // Medians, since the occasional slow fork would swamp the difference.
+  printf("{\"benchmark\":\"startup_overhead\",\"iterations\":%" PRIu64
+         ",\"median_ns\":%" PRId64 "}\n",
+         runs, (int64_t)preloaded[runs / 2] - (int64_t)plain[runs / 2]);
+  return 0;
+}
@@ -14,11 +14,11 @@
               meson
               ninja
               pkg-config
+              python3
             ];
             buildInputs = with pkgs; [
               wayland
               wayland-protocols
-              glib
             ];
           };
           default = gtkcursorshape;
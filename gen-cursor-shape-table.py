@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+# Generates the cursor name -> shape perfect hash table used by wlcursorfix.
+#
+# Copyright 2024 John Chadwick <john@jchw.io>
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+# Usage: gen-cursor-shape-table.py cursor-names.txt cursor-shape-v1.xml out.h
+#
+# The table uses hash-and-displace: a name first hashes (with seed 0) to a
+# bucket, and the bucket's displacement is the seed of a second hash that
+# picks the name's slot. Displacements are chosen here so that no two names
+# share a slot, so a lookup is two hashes and one string compare.
+
+import sys
+import xml.etree.ElementTree as ET
+
+# Highest wp_cursor_shape_manager_v1 version the shim binds.
+BOUND_VERSION = 1
+
+
+def fail(message):
+    sys.exit(f"gen-cursor-shape-table.py: {message}")
+
+
+# 32-bit FNV-1a with the seed mixed into the offset basis. Must match
+# cursor_name_hash() in wlcursorfix.c.
+def fnv1a(seed, name):
+    h = (0x811C9DC5 ^ seed) & 0xFFFFFFFF
+    for byte in name.encode():
+        h ^= byte
+        h = (h * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def read_shapes(path):
+    shapes = {}
+    root = ET.parse(path).getroot()
+    for interface in root.iter("interface"):
+        if interface.get("name") != "wp_cursor_shape_device_v1":
+            continue
+        for enum in interface.iter("enum"):
+            if enum.get("name") != "shape":
+                continue
+            for entry in enum.iter("entry"):
+                shapes[entry.get("name")] = (
+                    int(entry.get("value"), 0),
+                    int(entry.get("since", "1")),
+                )
+    if not shapes:
+        fail(f"no wp_cursor_shape_device_v1.shape enum in {path}")
+    return shapes
+
+
+def read_names(path, shapes):
+    names = {}
+    used_shapes = set()
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            fields = line.split("#", 1)[0].split()
+            if not fields:
+                continue
+            shape, aliases = fields[0], fields[1:]
+            where = f"{path}:{number}"
+            if shape not in shapes:
+                fail(f"{where}: {shape} is not a cursor-shape-v1 shape")
+            if shapes[shape][1] > BOUND_VERSION:
+                fail(f"{where}: {shape} needs cursor-shape-v1 version "
+                     f"{shapes[shape][1]}, but we bind version {BOUND_VERSION}")
+            if not aliases:
+                fail(f"{where}: no cursor names for {shape}")
+            for alias in aliases:
+                if alias in names:
+                    fail(f"{where}: {alias} is already mapped to {names[alias]}")
+                names[alias] = shape
+            used_shapes.add(shape)
+    for shape, (_, since) in shapes.items():
+        if since <= BOUND_VERSION and shape not in used_shapes:
+            fail(f"{path}: no cursor names for shape {shape}")
+    return names
+
+
+def build_table(names):
+    size = 1
+    while size < len(names) * 2:
+        size *= 2
+    bucket_count = max(1, len(names) // 4)
+    buckets = [[] for _ in range(bucket_count)]
+    for name in names:
+        buckets[fnv1a(0, name) % bucket_count].append(name)
+    slots = [None] * size
+    displacements = [0] * bucket_count
+    order = sorted(range(bucket_count), key=lambda i: -len(buckets[i]))
+    for index in order:
+        bucket = buckets[index]
+        if not bucket:
+            continue
+        for seed in range(1, 1 << 20):
+            chosen = {fnv1a(seed, name) & (size - 1) for name in bucket}
+            if len(chosen) == len(bucket) and all(slots[s] is None for s in chosen):
+                break
+        else:
+            fail("couldn't find a perfect hash")
+        displacements[index] = seed
+        for name in bucket:
+            slots[fnv1a(seed, name) & (size - 1)] = name
+    return displacements, slots
+
+
+def main():
+    if len(sys.argv) != 4:
+        fail("usage: gen-cursor-shape-table.py cursor-names.txt "
+             "cursor-shape-v1.xml output.h")
+    shapes = read_shapes(sys.argv[2])
+    names = read_names(sys.argv[1], shapes)
+    displacements, slots = build_table(names)
+
+    def constant(shape):
+        return f"WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_{shape.upper()}"
+
+    out = []
+    out.append("// Generated by gen-cursor-shape-table.py from cursor-names.txt.")
+    out.append("// Do not edit.")
+    out.append("")
+    out.append(f"#define CURSOR_SHAPE_TABLE_SIZE {len(slots)}")
+    out.append(f"#define CURSOR_SHAPE_BUCKET_COUNT {len(displacements)}")
+    out.append("")
+    out.append("static const uint32_t "
+               "cursor_shape_displacements[CURSOR_SHAPE_BUCKET_COUNT] = {")
+    for i in range(0, len(displacements), 8):
+        row = ", ".join(str(d) for d in displacements[i:i + 8])
+        out.append(f"    {row},")
+    out.append("};")
+    out.append("")
+    out.append("static const struct cursor_shape_entry "
+               "cursor_shape_table[CURSOR_SHAPE_TABLE_SIZE] = {")
+    for slot, name in enumerate(slots):
+        if name is not None:
+            out.append(f'    [{slot}] = {{"{name}", {constant(names[name])}}},')
+    out.append("};")
+    out.append("")
+    out.append("// The scanner's constants must agree with the XML we generated from.")
+    for shape in sorted(set(names.values()), key=lambda s: shapes[s][0]):
+        out.append(f"_Static_assert({constant(shape)} == {shapes[shape][0]},")
+        out.append(f'               "{shape} does not match cursor-shape-v1.xml");')
+
+    with open(sys.argv[3], "w") as f:
+        f.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()
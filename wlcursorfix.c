@@ -15,40 +15,100 @@
 // ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
-#define G_LOG_USE_STRUCTURED
-#ifndef G_LOG_DOMAIN
-#define G_LOG_DOMAIN "wlcursorfix"
-#endif
-
 #define _GNU_SOURCE
 #include <assert.h>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <elf.h>
-#include <glib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <link.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <threads.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cursor-shape-v1-client-protocol.h>
+#include <fractional-scale-v1-client-protocol.h>
 #include <tablet-unstable-v2-client-protocol.h>
+#include <viewporter-client-protocol.h>
 #include <wayland-cursor.h>
 
 static unsigned int
 gdk_wayland_display_cursor_buffer_shape(void *display,
                                         struct wl_buffer *buffer);
+static void gtk_theme_index_forget_buffer(struct wl_buffer *buffer);
+static unsigned int shm_buffer_content_shape(struct wl_buffer *buffer);
+static void forget_deferred_set_cursor(struct wl_proxy *proxy);
+static void forget_display_deferrals(struct wl_display *display);
+static void init_capture(void);
+
+//
+// Logging
+//
+
+// Debug messages go to stderr when WLCURSORFIX_DEBUG is set to anything but
+// 0. G_MESSAGES_DEBUG=wlcursorfix (or all) still works too, from when these
+// went through GLib's logging.
+
+static bool log_domain_listed(const char *domains) {
+  static const char domain[] = "wlcursorfix";
+  for (const char *p = domains; *p;) {
+    size_t length = strcspn(p, " ,:");
+    if ((length == sizeof(domain) - 1 && memcmp(p, domain, length) == 0) ||
+        (length == 3 && memcmp(p, "all", 3) == 0)) {
+      return true;
+    }
+    p += length;
+    p += strspn(p, " ,:");
+  }
+  return false;
+}
+
+static bool debug_enabled(void) {
+  // -1 until the environment has been checked
+  static atomic_int enabled = -1;
+  int value = atomic_load_explicit(&enabled, memory_order_relaxed);
+  if (value < 0) {
+    const char *debug = getenv("WLCURSORFIX_DEBUG");
+    const char *domains = getenv("G_MESSAGES_DEBUG");
+    value = (debug && *debug && strcmp(debug, "0") != 0) ||
+            (domains && log_domain_listed(domains));
+    atomic_store_explicit(&enabled, value, memory_order_relaxed);
+  }
+  return value;
+}
+
+static void __attribute__((format(printf, 1, 2)))
+log_debug(const char *format, ...) {
+  if (!debug_enabled()) {
+    return;
+  }
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  fprintf(stderr, "wlcursorfix-DEBUG: %s\n", message);
+}
 //
 // Internal structures
 //
 
-// libwayland doesn't provide a way to get the wl_display from a wl_proxy
-// object, but there are several locations where being able to do this greatly
-// improves the code, so we pry into the implementation. This is liable to break
-// at any time, though it might not. Dunno.
+// libwayland doesn't provide a way to get the wl_display or event queue from a
+// wl_proxy object, but there are several locations where being able to do this
+// greatly improves the code, so we pry into the implementation. This is liable
+// to break at any time, though it might not. Dunno.
 struct wl_object {
   const struct wl_interface *interface;
   const void *implementation;
@@ -57,6 +117,7 @@ struct wl_object {
 struct wl_proxy {
   struct wl_object object;
   struct wl_display *display;
+  struct wl_event_queue *queue;
 };
 
 // GTK4 uses a vendored version of libwayland-cursor that loads cursors
@@ -81,520 +142,3843 @@ struct gtk_cursor_image {
   struct wl_buffer *buffer;
 };
 
-// TODO: Should verify that these mappings are accurate.
-// TODO: add more legacy Xcursor mappings?
-const static struct {
+// A wp_cursor_shape_device_v1 along with the last serial and shape we set on
+// it, packed as serial << 32 | shape.
+struct cursor_shape_device {
+  struct wp_cursor_shape_device_v1 *device;
+  _Atomic uint64_t last_shape;
+  // In coalescing mode, the set_shape still to be sent, packed the same way,
+  // or 0
+  _Atomic uint64_t pending_shape;
+  // The wl_pointer or zwp_tablet_tool_v2 it is for, and the display context
+  // that owns it
+  struct wl_proxy *object;
+  struct display_context *context;
+  struct cursor_shape_device *next;
+};
+
+// An entry of the cursor name -> shape table. The table itself is generated
+// from cursor-names.txt at build time; see gen-cursor-shape-table.py.
+struct cursor_shape_entry {
   const char *name;
-  const unsigned int shape;
-} cursor_shape_list[] = {
-    {"default", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_DEFAULT},
-    {"left_ptr", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_DEFAULT},
-    {"help", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_HELP},
-    {"context-menu", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_CONTEXT_MENU},
-    {"pointer", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_POINTER},
-    {"progress", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_PROGRESS},
-    {"wait", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_WAIT},
-    {"cell", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_CELL},
-    {"crosshair", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_CROSSHAIR},
-    {"text", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_TEXT},
-    {"xterm", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_TEXT},
-    {"vertical-text", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_VERTICAL_TEXT},
-    {"alias", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ALIAS},
-    {"copy", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_COPY},
-    {"move", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_MOVE},
-    {"no-drop", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NO_DROP},
-    {"dnd-ask", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_COPY},
-    {"not-allowed", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NOT_ALLOWED},
-    {"grab", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_GRAB},
-    {"grabbing", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_GRABBING},
-    {"all-scroll", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ALL_SCROLL},
-    {"col-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_COL_RESIZE},
-    {"row-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ROW_RESIZE},
-    {"n-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_N_RESIZE},
-    {"e-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_E_RESIZE},
-    {"s-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_S_RESIZE},
-    {"w-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_W_RESIZE},
-    {"ne-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NE_RESIZE},
-    {"nw-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NW_RESIZE},
-    {"se-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_SE_RESIZE},
-    {"sw-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_SW_RESIZE},
-    {"ew-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_EW_RESIZE},
-    {"ns-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_EW_RESIZE},
-    {"nesw-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NESW_RESIZE},
-    {"nwse-resize", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NWSE_RESIZE},
-    {"zoom-in", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ZOOM_IN},
-    {"zoom-out", WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ZOOM_OUT},
+  unsigned int shape;
 };
 
-static mtx_t mutex;
+#include "cursor-shape-table.h"
 
-// Map of cursor name -> shape
-static GHashTable *cursor_shape_map;
-// Map of wl_buffer -> shape
-static GHashTable *buffer_shape_map;
-// Map of wl_display -> wp_cursor_shape_manager_v1
-static GHashTable *display_cursor_shape_manager_map;
-// Map of wl_proxy -> wp_cursor_shape_device_v1
-static GHashTable *object_cursor_shape_device_map;
-// Boolean that is set to true inside gtk_init
-static atomic_bool in_gtk_init = false;
-// Captured GdkWaylandDisplay from gtk_init call
-static void *_Atomic gdk_wayland_display;
+//
+// Pointer map
+//
 
-// Initialize global structures
-static void __attribute__((constructor)) init(void) {
-  static atomic_flag initialized = ATOMIC_FLAG_INIT;
-  if (atomic_flag_test_and_set(&initialized)) {
-    return;
+// Keys 0 and 1 are never valid pointers, so they mark empty and deleted slots.
+#define MAP_EMPTY_KEY ((uintptr_t)0)
+#define MAP_TOMBSTONE_KEY ((uintptr_t)1)
+
+static inline size_t pointer_hash(uintptr_t key) {
+  return (size_t)(((uint64_t)key * UINT64_C(0x9e3779b97f4a7c15)) >> 32);
+}
+
+// Simple open-addressing map from pointers to integers, for state that is
+// only ever touched under a lock.
+struct ptr_map_entry {
+  uintptr_t key;
+  uintptr_t value;
+};
+
+struct ptr_map {
+  size_t capacity;
+  // Slots that are not empty, including tombstones.
+  size_t used;
+  struct ptr_map_entry *entries;
+};
+
+#define PTR_MAP_INIT {0, 0, NULL}
+
+static struct ptr_map_entry *ptr_map_find(const struct ptr_map *map,
+                                          const void *key) {
+  if (!map->entries) {
+    return NULL;
+  }
+  size_t mask = map->capacity - 1;
+  for (size_t i = pointer_hash((uintptr_t)key) & mask;; i = (i + 1) & mask) {
+    if (map->entries[i].key == (uintptr_t)key) {
+      return &map->entries[i];
+    }
+    if (map->entries[i].key == MAP_EMPTY_KEY) {
+      return NULL;
+    }
   }
-  mtx_init(&mutex, mtx_plain);
-  cursor_shape_map = g_hash_table_new(g_str_hash, g_str_equal);
-  for (int i = 0; i < sizeof(cursor_shape_list) / sizeof(*cursor_shape_list);
-       ++i) {
-    g_hash_table_insert(cursor_shape_map, (gpointer)cursor_shape_list[i].name,
-                        GUINT_TO_POINTER(cursor_shape_list[i].shape));
-  }
-  buffer_shape_map = g_hash_table_new(g_direct_hash, g_direct_equal);
-  display_cursor_shape_manager_map =
-      g_hash_table_new(g_direct_hash, g_direct_equal);
-  object_cursor_shape_device_map =
-      g_hash_table_new(g_direct_hash, g_direct_equal);
-  gdk_wayland_display = NULL;
-  g_debug("wlcursorfix initialized");
 }
 
-// Register wl_cursor buffers for the corresponding shape to name
-static void register_wl_cursor_buffers(const char *name,
-                                       struct wl_cursor *cursor) {
-  gpointer orig_key, value;
-  if (!g_hash_table_lookup_extended(cursor_shape_map, name, &orig_key,
-                                    &value)) {
-    g_debug("no cursor image for name %s", name);
-    return;
+// Look up the value for key, or 0 if there is none.
+static uintptr_t ptr_map_lookup(const struct ptr_map *map, const void *key) {
+  struct ptr_map_entry *entry = ptr_map_find(map, key);
+  return entry ? entry->value : 0;
+}
+
+static bool ptr_map_resize(struct ptr_map *map) {
+  size_t live = 0;
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (map->entries[i].key > MAP_TOMBSTONE_KEY) {
+      live++;
+    }
   }
-  g_debug("register cursor shape %d", GPOINTER_TO_UINT(value));
-  mtx_lock(&mutex);
-  for (int i = 0; i < cursor->image_count; i++) {
-    struct wl_buffer *buffer = wl_cursor_image_get_buffer(cursor->images[i]);
-    g_debug("registered buffer %p as %s", buffer, name);
-    g_hash_table_insert(buffer_shape_map, buffer, value);
+  size_t capacity = 16;
+  while (capacity < (live + 1) * 4) {
+    capacity *= 2;
   }
-  mtx_unlock(&mutex);
+  struct ptr_map_entry *entries = calloc(capacity, sizeof(*entries));
+  if (!entries) {
+    return false;
+  }
+  for (size_t i = 0; i < map->capacity; i++) {
+    uintptr_t key = map->entries[i].key;
+    if (key > MAP_TOMBSTONE_KEY) {
+      size_t j = pointer_hash(key) & (capacity - 1);
+      while (entries[j].key != MAP_EMPTY_KEY) {
+        j = (j + 1) & (capacity - 1);
+      }
+      entries[j] = map->entries[i];
+    }
+  }
+  free(map->entries);
+  map->entries = entries;
+  map->capacity = capacity;
+  map->used = live;
+  return true;
 }
 
-// Look up shape that corresponds to buffer
-static unsigned int lookup_buffer_shape(struct wl_buffer *buffer) {
-  mtx_lock(&mutex);
-  unsigned int shape =
-      GPOINTER_TO_UINT(g_hash_table_lookup(buffer_shape_map, buffer));
-  mtx_unlock(&mutex);
-  if (!shape && gdk_wayland_display) {
-    // GTK4: Try searching the current GTK cursor theme
-    shape =
-        gdk_wayland_display_cursor_buffer_shape(gdk_wayland_display, buffer);
+// Insert or replace the value for key.
+static bool ptr_map_insert(struct ptr_map *map, const void *key,
+                           uintptr_t value) {
+  struct ptr_map_entry *entry = ptr_map_find(map, key);
+  if (entry) {
+    entry->value = value;
+    return true;
   }
-  return shape;
+  if ((map->used + 1) * 4 > map->capacity * 3 && !ptr_map_resize(map)) {
+    return false;
+  }
+  size_t mask = map->capacity - 1;
+  size_t i = pointer_hash((uintptr_t)key) & mask;
+  while (map->entries[i].key > MAP_TOMBSTONE_KEY) {
+    i = (i + 1) & mask;
+  }
+  if (map->entries[i].key == MAP_EMPTY_KEY) {
+    map->used++;
+  }
+  map->entries[i].key = (uintptr_t)key;
+  map->entries[i].value = value;
+  return true;
 }
 
-// Register global shape manager for display
-static void register_display_shape_manager(
-    struct wl_display *display,
-    struct wp_cursor_shape_manager_v1 *cursor_shape_manager) {
-  mtx_lock(&mutex);
-  if (g_hash_table_lookup(display_cursor_shape_manager_map,
-                          (gpointer)display) != NULL) {
-    mtx_unlock(&mutex);
-    return;
+// Remove key. Returns the value it had, or 0 if there was none.
+static uintptr_t ptr_map_remove(struct ptr_map *map, const void *key) {
+  struct ptr_map_entry *entry = ptr_map_find(map, key);
+  if (!entry) {
+    return 0;
   }
-  g_hash_table_insert(display_cursor_shape_manager_map, (gpointer)display,
-                      (gpointer)cursor_shape_manager);
-  mtx_unlock(&mutex);
+  entry->key = MAP_TOMBSTONE_KEY;
+  return entry->value;
 }
 
-static struct wp_cursor_shape_device_v1 *
-get_cursor_shape_device(struct wl_proxy *object, bool tablet_tool) {
-  struct wp_cursor_shape_device_v1 *cursor_shape_device = NULL;
-  struct wp_cursor_shape_manager_v1 *cursor_shape_manager = NULL;
+static void ptr_map_clear(struct ptr_map *map) {
+  free(map->entries);
+  map->entries = NULL;
+  map->capacity = 0;
+  map->used = 0;
+}
 
-  // Lock to search hash tables
-  mtx_lock(&mutex);
-  {
-    // Try to get the cursor shape device if we already acquired it
-    cursor_shape_device =
-        g_hash_table_lookup(object_cursor_shape_device_map, object);
-    if (cursor_shape_device != NULL) {
-      mtx_unlock(&mutex);
-      return cursor_shape_device;
-    }
+//
+// Per-thread state
+//
 
-    // If not, we need to get the cursor shape manager for the display
-    cursor_shape_manager = g_hash_table_lookup(display_cursor_shape_manager_map,
-                                               (gpointer)object->display);
-  }
-  mtx_unlock(&mutex);
+// Runtime counters, kept per thread and only summed up when dumped.
+#define STATS(X)                                                               \
+  X(requests_intercepted)                                                      \
+  X(set_cursor_deferred)                                                       \
+  X(set_cursor_flushed)                                                        \
+  X(set_cursor_memo_hits)                                                      \
+  X(set_shape_coalesced)                                                       \
+  X(get_cursor_memo_hits)                                                      \
+  X(buffer_map_hits)                                                           \
+  X(buffer_map_misses)                                                         \
+  X(gtk_theme_scans)                                                           \
+  X(gtk_images_visited)                                                        \
+  X(shm_buffers_hashed)                                                        \
+  X(shm_buffers_matched)                                                       \
+  X(xcursor_index_builds)                                                      \
+  X(shape_devices_created)                                                     \
+  X(mutex_wait_ns)
 
-  // If there is no cursor shape manager for the display, exit
-  if (!cursor_shape_manager) {
-    return NULL;
-  }
+enum stat_id {
+#define STAT_ENUM(name) STAT_##name,
+  STATS(STAT_ENUM)
+#undef STAT_ENUM
+      STAT_COUNT,
+};
 
-  // Get the cursor shape manager for the device
-  if (tablet_tool) {
-    cursor_shape_device = wp_cursor_shape_manager_v1_get_tablet_tool_v2(
-        cursor_shape_manager, (struct zwp_tablet_tool_v2 *)object);
-  } else {
-    cursor_shape_device = wp_cursor_shape_manager_v1_get_pointer(
-        cursor_shape_manager, (struct wl_pointer *)object);
+// Every thread that calls into the shim gets one of these. Records of exited
+// threads are recycled, so their counts carry over to the next owner.
+struct thread_state {
+  // Epoch this thread entered its read section at, or 0 if not reading.
+  _Atomic uint64_t epoch;
+  atomic_bool in_use;
+  struct thread_state *next;
+  // Only ever written by the owning thread.
+  _Atomic uint64_t stats[STAT_COUNT];
+  // Ring of trace events, allocated on first use; see "Tracing".
+  struct trace_event *trace;
+  _Atomic uint64_t trace_head;
+};
+
+static _Atomic uint64_t global_epoch = 1;
+static struct thread_state *_Atomic thread_states;
+static tss_t thread_state_key;
+static thread_local struct thread_state *current_thread_state;
+
+static void release_thread_state(void *data) {
+  struct thread_state *state = data;
+  atomic_store(&state->epoch, 0);
+  atomic_store(&state->in_use, false);
+}
+
+// Get the calling thread's state record, reusing records of exited threads.
+static struct thread_state *thread_state(void) {
+  struct thread_state *state = current_thread_state;
+  if (state) {
+    return state;
   }
-  if (!cursor_shape_device) {
-    return NULL;
+  for (state = atomic_load(&thread_states); state; state = state->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&state->in_use, &expected, true)) {
+      break;
+    }
+  }
+  if (!state) {
+    state = calloc(1, sizeof(*state));
+    atomic_init(&state->in_use, true);
+    state->next = atomic_load(&thread_states);
+    while (!atomic_compare_exchange_weak(&thread_states, &state->next, state))
+      ;
   }
+  tss_set(thread_state_key, state);
+  current_thread_state = state;
+  return state;
+}
 
-  // Lock to write to hash tables
-  mtx_lock(&mutex);
-  {
-    // Another thread may have raced us: if we lost the race, we should destroy
-    // ours and return theirs. We do this because holding the lock while calling
-    // other Wayland functions may be dangerous.
-    struct wp_cursor_shape_device_v1 *other_cursor_shape_device =
-        g_hash_table_lookup(object_cursor_shape_device_map, object);
-    if (other_cursor_shape_device != NULL) {
-      mtx_unlock(&mutex);
-      wp_cursor_shape_device_v1_destroy(cursor_shape_device);
-      return other_cursor_shape_device;
-    }
-    // We win the race, insert it.
-    g_hash_table_insert(object_cursor_shape_device_map, object,
-                        cursor_shape_device);
+static inline void stat_add(enum stat_id stat, uint64_t n) {
+  // Single writer, so no need for an atomic read-modify-write.
+  _Atomic uint64_t *counter = &thread_state()->stats[stat];
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Lock a mutex, accounting for the time spent waiting on it.
+static void lock_mutex(mtx_t *mutex) {
+  if (mtx_trylock(mutex) == thrd_success) {
+    return;
   }
-  mtx_unlock(&mutex);
-  return cursor_shape_device;
+  uint64_t start = monotonic_ns();
+  mtx_lock(mutex);
+  stat_add(STAT_mutex_wait_ns, monotonic_ns() - start);
 }
 
 //
-// Wayland registry hook
+// Lock-free pointer map
 //
 
-typedef struct {
-  void *data;
-  struct wl_registry_listener *implementation;
-} registry_hook_data;
+// Readers on the hot path (the marshal hook, in whatever thread the
+// application renders from) must never block, so the maps they use are
+// read-mostly open-addressing tables. Readers just load the current table and
+// probe it. Writers serialize on the map's own lock and publish a larger table
+// when the old one fills up. Retired tables are freed once every thread that
+// might still be reading them has left its read section, which each thread
+// announces by publishing the global epoch it entered at.
 
-static void registry_handle_global(void *data, struct wl_registry *registry,
-                                   uint32_t id, const char *interface,
-                                   uint32_t version) {
-  registry_hook_data *hook_data = (registry_hook_data *)data;
-  hook_data->implementation->global(hook_data->data, registry, id, interface,
-                                    version);
-  if (strcmp(interface, "wp_cursor_shape_manager_v1") == 0) {
-    struct wl_display *display = ((struct wl_proxy *)registry)->display;
-    g_debug("acquired wp_cursor_shape_manager_v1");
-    register_display_shape_manager(
-        display,
-        wl_registry_bind(registry, id, &wp_cursor_shape_manager_v1_interface,
-                         MIN(version, 1)));
-  }
+static inline struct thread_state *read_section_enter(void) {
+  struct thread_state *state = thread_state();
+  atomic_store(&state->epoch, atomic_load(&global_epoch));
+  return state;
+}
 
-  return;
+static inline void read_section_exit(struct thread_state *state) {
+  atomic_store_explicit(&state->epoch, 0, memory_order_release);
 }
 
-static void registry_handle_global_remove(void *data,
-                                          struct wl_registry *registry,
-                                          uint32_t id) {
-  registry_hook_data *hook_data = (registry_hook_data *)data;
-  hook_data->implementation->global_remove(hook_data->data, registry, id);
+// Oldest epoch any thread is currently reading at, or UINT64_MAX.
+static uint64_t oldest_read_epoch(void) {
+  uint64_t oldest = UINT64_MAX;
+  for (struct thread_state *state = atomic_load(&thread_states); state;
+       state = state->next) {
+    uint64_t epoch = atomic_load(&state->epoch);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+  return oldest;
 }
 
-static const struct wl_registry_listener registry_listener = {
-    registry_handle_global,
-    registry_handle_global_remove,
+#define LF_MAP_MIN_CAPACITY 64
+
+struct lf_map_entry {
+  _Atomic uintptr_t key;
+  _Atomic uintptr_t value;
 };
 
-//
-// Wayland Hooks
-//
+struct lf_map_table {
+  size_t capacity;
+  // Slots that are not empty, including tombstones. Only touched by writers.
+  size_t used;
+  struct lf_map_table *retired_next;
+  uint64_t retired_epoch;
+  struct lf_map_entry entries[];
+};
 
-int wl_proxy_add_listener(struct wl_proxy *proxy, void (**implementation)(void),
-                          void *data) {
-  static int (*next)(struct wl_proxy *proxy, void (**implementation)(void),
-                     void *data);
-  if (!next) {
-    next = dlsym(RTLD_NEXT, "wl_proxy_add_listener");
-  }
-  if (strcmp(wl_proxy_get_class(proxy), "wl_registry") == 0) {
-    g_debug("installing listener proxy for wl_registry");
-    registry_hook_data *hook_data = malloc(sizeof(registry_hook_data));
-    hook_data->data = data;
-    hook_data->implementation = (struct wl_registry_listener *)implementation;
-    implementation = (void (**)(void)) & registry_listener;
-    data = (void *)hook_data;
-    if (in_gtk_init) {
-      in_gtk_init = false;
-      gdk_wayland_display = hook_data->data;
-      g_debug("captured GdkWaylandDisplay: %p", gdk_wayland_display);
+struct lf_map {
+  struct lf_map_table *_Atomic table;
+  struct lf_map_table *retired;
+  mtx_t lock;
+};
+
+static void lf_map_init(struct lf_map *map) {
+  atomic_init(&map->table, NULL);
+  map->retired = NULL;
+  mtx_init(&map->lock, mtx_plain);
+}
+
+// Look up the value for key, or 0 if there is none.
+static uintptr_t lf_map_lookup(struct lf_map *map, const void *key) {
+  struct thread_state *state = read_section_enter();
+  uintptr_t value = 0;
+  struct lf_map_table *table = atomic_load(&map->table);
+  if (table) {
+    size_t mask = table->capacity - 1;
+    for (size_t i = pointer_hash((uintptr_t)key) & mask;;
+         i = (i + 1) & mask) {
+      uintptr_t slot_key = atomic_load_explicit(&table->entries[i].key,
+                                                memory_order_acquire);
+      if (slot_key == (uintptr_t)key) {
+        value = atomic_load_explicit(&table->entries[i].value,
+                                     memory_order_relaxed);
+        break;
+      }
+      if (slot_key == MAP_EMPTY_KEY) {
+        break;
+      }
     }
   }
-  return next(proxy, implementation, data);
+  read_section_exit(state);
+  return value;
 }
 
-struct wl_cursor *wl_cursor_theme_get_cursor(struct wl_cursor_theme *theme,
-                                             const char *name) {
-  static struct wl_cursor *(*next)(struct wl_cursor_theme *, const char *name);
-  if (!next) {
-    next = dlsym(RTLD_NEXT, "wl_cursor_theme_get_cursor");
+// Free retired tables that no reader can still be looking at. Must be called
+// with the map lock held.
+static void lf_map_reclaim(struct lf_map *map) {
+  if (!map->retired) {
+    return;
   }
-  struct wl_cursor *cursor = next(theme, name);
-  if (cursor) {
-    register_wl_cursor_buffers(name, cursor);
+  uint64_t oldest = oldest_read_epoch();
+  struct lf_map_table **link = &map->retired;
+  while (*link) {
+    struct lf_map_table *table = *link;
+    if (table->retired_epoch < oldest) {
+      *link = table->retired_next;
+      free(table);
+    } else {
+      link = &table->retired_next;
+    }
   }
-  return cursor;
 }
 
-struct wl_proxy *
-wl_proxy_marshal_array_flags(struct wl_proxy *proxy, uint32_t opcode,
-                             const struct wl_interface *interface,
-                             uint32_t version, uint32_t flags,
-                             union wl_argument *args) {
-  static struct wl_proxy *(*next)(struct wl_proxy *proxy, uint32_t opcode,
-                                  const struct wl_interface *interface,
-                                  uint32_t version, uint32_t flags,
-                                  union wl_argument *args);
-  if (!next) {
-    next = dlsym(RTLD_NEXT, "wl_proxy_marshal_array_flags");
-  }
-  static thread_local struct {
-    struct wl_proxy *object;
-    uint32_t version;
-    uint32_t enter_serial;
-    struct wl_surface *pointer_surface;
-    int32_t x, y;
-    bool tablet_tool;
-  } deferred_set_cursor_data = {0};
-  const char *class = wl_proxy_get_class(proxy);
-  const bool is_wl_surface_request = strcmp(class, "wl_surface") == 0;
-  const bool is_wl_pointer_request = strcmp(class, "wl_pointer") == 0;
-  const bool is_zwp_tablet_tool_v2_request =
-      strcmp(class, "zwp_tablet_tool_v2") == 0;
-  const bool proxy_is_deferred_pointer_surface =
-      proxy != NULL &&
-      proxy == (struct wl_proxy *)deferred_set_cursor_data.pointer_surface;
-
-  if (is_wl_surface_request && proxy_is_deferred_pointer_surface) {
-    unsigned int shape;
-    switch (opcode) {
-    case WL_SURFACE_ATTACH:
-      shape = lookup_buffer_shape((struct wl_buffer *)args[0].o);
-      if (shape == 0) {
-        g_debug("no shape found for buffer %p", args[0].o);
-        break;
+// Place key into a table that is not yet visible to readers.
+static void lf_map_table_place(struct lf_map_table *table, uintptr_t key,
+                               uintptr_t value) {
+  size_t mask = table->capacity - 1;
+  size_t i = pointer_hash(key) & mask;
+  while (atomic_load_explicit(&table->entries[i].key, memory_order_relaxed) !=
+         MAP_EMPTY_KEY) {
+    i = (i + 1) & mask;
+  }
+  atomic_init(&table->entries[i].key, key);
+  atomic_init(&table->entries[i].value, value);
+  table->used++;
+}
+
+// Publish a fresh table sized for the live entries of the current one. Must be
+// called with the map lock held.
+static struct lf_map_table *lf_map_rehash(struct lf_map *map,
+                                          struct lf_map_table *old) {
+  size_t live = 0;
+  if (old) {
+    for (size_t i = 0; i < old->capacity; i++) {
+      if (atomic_load_explicit(&old->entries[i].key, memory_order_relaxed) >
+          MAP_TOMBSTONE_KEY) {
+        live++;
       }
-      struct wp_cursor_shape_device_v1 *cursor_shape_device =
-          get_cursor_shape_device(deferred_set_cursor_data.object,
-                                  deferred_set_cursor_data.tablet_tool);
-      g_debug("mapped buffer %p to shape %d for device %p", args[0].o, shape,
-              cursor_shape_device);
-      wp_cursor_shape_device_v1_set_shape(
-          cursor_shape_device, deferred_set_cursor_data.enter_serial, shape);
-      return NULL;
-    case WL_SURFACE_SET_BUFFER_SCALE:
-    case WL_SURFACE_DAMAGE:
-      return NULL;
-    case WL_SURFACE_COMMIT:
-      // Still mask this, but also clear the deferred set_cursor now.
-      memset(&deferred_set_cursor_data, 0, sizeof(deferred_set_cursor_data));
-      return NULL;
     }
   }
-  if (deferred_set_cursor_data.pointer_surface != NULL) {
-    // If there is a pending deferred wl_pointer_set_cursor, call it now.
-    union wl_argument args[4] = {
-        {.u = deferred_set_cursor_data.enter_serial},
-        {.o = (struct wl_object *)deferred_set_cursor_data.pointer_surface},
-        {.i = deferred_set_cursor_data.x},
-        {.i = deferred_set_cursor_data.y},
-    };
-    g_debug("flush deferred set_cursor operation");
-    next(deferred_set_cursor_data.object, WL_POINTER_SET_CURSOR, NULL,
-         deferred_set_cursor_data.version, 0, args);
-    memset(&deferred_set_cursor_data, 0, sizeof(deferred_set_cursor_data));
-  }
-  // If the next Wayland call is wl_pointer_set_cursor, defer it.
-  if (is_wl_pointer_request && opcode == WL_POINTER_SET_CURSOR) {
-    deferred_set_cursor_data.object = proxy;
-    deferred_set_cursor_data.version = version;
-    deferred_set_cursor_data.enter_serial = args[0].u;
-    deferred_set_cursor_data.pointer_surface = (struct wl_surface *)args[1].o;
-    deferred_set_cursor_data.x = args[2].i;
-    deferred_set_cursor_data.y = args[3].i;
-    deferred_set_cursor_data.tablet_tool = false;
-    return NULL;
-  } else if (is_zwp_tablet_tool_v2_request &&
-             opcode == ZWP_TABLET_TOOL_V2_SET_CURSOR) {
-    deferred_set_cursor_data.object = proxy;
-    deferred_set_cursor_data.version = version;
-    deferred_set_cursor_data.enter_serial = args[0].u;
-    deferred_set_cursor_data.pointer_surface = (struct wl_surface *)args[1].o;
-    deferred_set_cursor_data.x = args[2].i;
-    deferred_set_cursor_data.y = args[3].i;
-    deferred_set_cursor_data.tablet_tool = true;
+  size_t capacity = LF_MAP_MIN_CAPACITY;
+  while (capacity < (live + 1) * 4) {
+    capacity *= 2;
+  }
+  struct lf_map_table *table = calloc(
+      1, sizeof(*table) + capacity * sizeof(struct lf_map_entry));
+  if (!table) {
     return NULL;
   }
-  return next(proxy, opcode, interface, version, flags, args);
+  table->capacity = capacity;
+  if (old) {
+    for (size_t i = 0; i < old->capacity; i++) {
+      uintptr_t key =
+          atomic_load_explicit(&old->entries[i].key, memory_order_relaxed);
+      if (key > MAP_TOMBSTONE_KEY) {
+        lf_map_table_place(table, key,
+                           atomic_load_explicit(&old->entries[i].value,
+                                                memory_order_relaxed));
+      }
+    }
+  }
+  atomic_store(&map->table, table);
+  if (old) {
+    old->retired_epoch = atomic_fetch_add(&global_epoch, 1);
+    old->retired_next = map->retired;
+    map->retired = old;
+  }
+  return table;
 }
 
-//
-// GTK hooks
-//
-
-static atomic_bool have_gtk4 = false;
-
-static struct gtk_wl_cursor_theme *(*_gdk_wayland_display_get_cursor_theme)(
-    void *display) = NULL;
+// Insert or replace the value for key. Value must not be 0. Returns the
+// previous value, or 0 if there was none.
+static uintptr_t lf_map_insert(struct lf_map *map, const void *key,
+                               uintptr_t value) {
+  uintptr_t previous = 0;
+  lock_mutex(&map->lock);
+  struct lf_map_table *table = atomic_load_explicit(&map->table,
+                                                    memory_order_relaxed);
+  if (!table || (table->used + 1) * 4 > table->capacity * 3) {
+    table = lf_map_rehash(map, table);
+    if (!table) {
+      mtx_unlock(&map->lock);
+      return 0;
+    }
+  }
+  size_t mask = table->capacity - 1;
+  size_t reuse = SIZE_MAX;
+  size_t i = pointer_hash((uintptr_t)key) & mask;
+  for (;; i = (i + 1) & mask) {
+    uintptr_t slot_key =
+        atomic_load_explicit(&table->entries[i].key, memory_order_relaxed);
+    if (slot_key == (uintptr_t)key) {
+      previous = atomic_exchange_explicit(&table->entries[i].value, value,
+                                          memory_order_relaxed);
+      break;
+    }
+    if (slot_key == MAP_TOMBSTONE_KEY && reuse == SIZE_MAX) {
+      reuse = i;
+    } else if (slot_key == MAP_EMPTY_KEY) {
+      if (reuse == SIZE_MAX) {
+        reuse = i;
+        table->used++;
+      }
+      atomic_store_explicit(&table->entries[reuse].value, value,
+                            memory_order_relaxed);
+      atomic_store_explicit(&table->entries[reuse].key, (uintptr_t)key,
+                            memory_order_release);
+      break;
+    }
+  }
+  lf_map_reclaim(map);
+  mtx_unlock(&map->lock);
+  return previous;
+}
 
-static char *gtk_cursor_theme_buffer_name(struct gtk_wl_cursor_theme *theme,
-                                          struct wl_buffer *buffer) {
-  for (int i = 0; i < theme->cursor_count; i++) {
-    struct gtk_wl_cursor *cursor = theme->cursors[i];
-    for (int j = 0; j < cursor->image_count; j++) {
-      struct gtk_cursor_image *image = cursor->images[j];
-      if (image->buffer == buffer) {
-        return cursor->name;
+// Remove key. Returns the value it had, or 0 if there was none.
+static uintptr_t lf_map_remove(struct lf_map *map, const void *key) {
+  uintptr_t previous = 0;
+  lock_mutex(&map->lock);
+  struct lf_map_table *table = atomic_load_explicit(&map->table,
+                                                    memory_order_relaxed);
+  if (table) {
+    size_t mask = table->capacity - 1;
+    for (size_t i = pointer_hash((uintptr_t)key) & mask;;
+         i = (i + 1) & mask) {
+      uintptr_t slot_key =
+          atomic_load_explicit(&table->entries[i].key, memory_order_relaxed);
+      if (slot_key == (uintptr_t)key) {
+        previous = atomic_load_explicit(&table->entries[i].value,
+                                        memory_order_relaxed);
+        atomic_store_explicit(&table->entries[i].key, MAP_TOMBSTONE_KEY,
+                              memory_order_release);
+        break;
+      }
+      if (slot_key == MAP_EMPTY_KEY) {
+        break;
       }
     }
   }
-  return NULL;
+  mtx_unlock(&map->lock);
+  return previous;
 }
 
-static unsigned int
-gtk_cursor_theme_buffer_shape(struct gtk_wl_cursor_theme *theme,
-                              struct wl_buffer *buffer) {
-  unsigned int shape = 0;
-  char *name = gtk_cursor_theme_buffer_name(theme, buffer);
-  gpointer orig_key, value;
-  if (!g_hash_table_lookup_extended(cursor_shape_map, name, &orig_key,
-                                    &value)) {
-    g_debug("no cursor image for name %s", name);
-    shape = 0;
-  } else {
-    shape = GPOINTER_TO_UINT(value);
+// Remove every key that maps to value.
+static void lf_map_remove_value(struct lf_map *map, uintptr_t value) {
+  lock_mutex(&map->lock);
+  struct lf_map_table *table = atomic_load_explicit(&map->table,
+                                                    memory_order_relaxed);
+  if (table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+      uintptr_t slot_key =
+          atomic_load_explicit(&table->entries[i].key, memory_order_relaxed);
+      if (slot_key > MAP_TOMBSTONE_KEY &&
+          atomic_load_explicit(&table->entries[i].value,
+                               memory_order_relaxed) == value) {
+        atomic_store_explicit(&table->entries[i].key, MAP_TOMBSTONE_KEY,
+                              memory_order_release);
+      }
+    }
   }
-  mtx_lock(&mutex);
-  g_hash_table_insert(buffer_shape_map, buffer, value);
-  mtx_unlock(&mutex);
-  if (shape != 0) {
-    g_debug("registered buffer %p (%s) as GTK cursor shape %d", buffer, name,
-            shape);
+  mtx_unlock(&map->lock);
+}
+
+//
+// Statistics
+//
+
+// Set WLCURSORFIX_STATS to a file name to get the counters dumped as JSON at
+// exit, and whenever the process gets WLCURSORFIX_STATS_SIGNAL (SIGUSR2 by
+// default). "%p" in the file name is replaced with the process ID. Dumping
+// only uses async-signal-safe calls, so it can run straight from the handler.
+
+static const char *stat_names[STAT_COUNT] = {
+#define STAT_NAME(name) #name,
+    STATS(STAT_NAME)
+#undef STAT_NAME
+};
+
+static const char *stats_path;
+
+struct stats_buffer {
+  char data[2048];
+  size_t length;
+};
+
+static void stats_append(struct stats_buffer *buffer, const char *string) {
+  while (*string && buffer->length < sizeof(buffer->data) - 1) {
+    buffer->data[buffer->length++] = *string++;
   }
-  return shape;
+  buffer->data[buffer->length] = '\0';
 }
 
-static unsigned int
-gdk_wayland_display_cursor_buffer_shape(void *display,
-                                        struct wl_buffer *buffer) {
-  struct gtk_wl_cursor_theme *theme =
-      _gdk_wayland_display_get_cursor_theme(display);
-  return gtk_cursor_theme_buffer_shape(theme, buffer);
+static void stats_append_u64(struct stats_buffer *buffer, uint64_t value) {
+  char digits[21];
+  size_t i = sizeof(digits) - 1;
+  digits[i] = '\0';
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  stats_append(buffer, &digits[i]);
 }
 
-static void init_gtk_hook() {
-  // We need to get a private (STB_LOCAL) symbol from symtab.
-  // Warning: This code may cause severe psychic damage to sensible people.
-  static atomic_flag initialized = ATOMIC_FLAG_INIT;
-  if (atomic_flag_test_and_set(&initialized)) {
-    return;
-  }
-  // TODO: maybe try to find a better symbol that reliably detects only GTK4
-  void *gtk_init = dlsym(RTLD_NEXT, "gtk_init");
-  if (!gtk_init) {
-    g_debug("no resident gtk found");
-    return;
+static void stats_append_json_string(struct stats_buffer *buffer,
+                                     const char *string) {
+  stats_append(buffer, "\"");
+  for (; *string; string++) {
+    char c[3] = {*string, '\0', '\0'};
+    if (*string == '"' || *string == '\\') {
+      c[0] = '\\';
+      c[1] = *string;
+    } else if ((unsigned char)*string < 0x20) {
+      c[0] = '?';
+    }
+    stats_append(buffer, c);
   }
-  Dl_info gtk_info;
-  if (!dladdr(gtk_init, &gtk_info)) {
-    g_debug("error resolving gtk_init info");
-    return;
+  stats_append(buffer, "\"");
+}
+
+// Expand "%p" in a file name to the process ID.
+static void expand_pid_path(struct stats_buffer *path, const char *pattern) {
+  for (const char *c = pattern; *c; c++) {
+    if (c[0] == '%' && c[1] == 'p') {
+      stats_append_u64(path, getpid());
+      c++;
+    } else {
+      char ch[2] = {*c, '\0'};
+      stats_append(path, ch);
+    }
   }
-  if (strstr(gtk_info.dli_fname, "libgtk-4.so") == NULL) {
-    g_debug("detected gtk but not gtk4");
+}
+
+static void dump_stats(void) {
+  if (!stats_path) {
     return;
   }
-  ElfW(Ehdr) *header = gtk_info.dli_fbase;
-  FILE *f = fopen(gtk_info.dli_fname, "r");
-  if (!f) {
-    g_debug("couldn't open gtk binary");
-    return;
+  uint64_t totals[STAT_COUNT] = {0};
+  unsigned int threads = 0;
+  for (struct thread_state *state = atomic_load(&thread_states); state;
+       state = state->next) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+      totals[i] += atomic_load_explicit(&state->stats[i], memory_order_relaxed);
+    }
+    threads++;
   }
-  ElfW(Shdr) *sections = malloc(header->e_shnum * sizeof(ElfW(Shdr)));
-  fseek(f, header->e_shoff, SEEK_SET);
-  if (fread(sections, header->e_shnum * sizeof(ElfW(Shdr)), 1, f) != 1) {
-    g_debug("couldn't load symbol table: %s", strerror(errno));
-    return;
+
+  struct stats_buffer path = {.length = 0};
+  expand_pid_path(&path, stats_path);
+
+  struct stats_buffer json = {.length = 0};
+  stats_append(&json, "{\"process\":");
+  stats_append_json_string(&json, program_invocation_short_name);
+  stats_append(&json, ",\"pid\":");
+  stats_append_u64(&json, getpid());
+  stats_append(&json, ",\"threads\":");
+  stats_append_u64(&json, threads);
+  for (int i = 0; i < STAT_COUNT; i++) {
+    stats_append(&json, ",\"");
+    stats_append(&json, stat_names[i]);
+    stats_append(&json, "\":");
+    stats_append_u64(&json, totals[i]);
   }
-  ElfW(Shdr) *shstr = &sections[header->e_shstrndx];
-  g_debug("header: %p; shstrndx: %d; shoff: %ld; shstrsize: %ld", header,
-          header->e_shstrndx, header->e_shoff, shstr->sh_size);
+  stats_append(&json, "}\n");
 
-  char *shstrbuf = malloc(shstr->sh_size);
-  g_debug("allocate %ld byte buffer: %p", shstr->sh_size, shstrbuf);
-  fseek(f, shstr->sh_offset, SEEK_SET);
-  if (fread(shstrbuf, shstr->sh_size, 1, f) != 1) {
-    g_debug("couldn't load symbol string table: %s", strerror(errno));
+  int fd = open(path.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
     return;
   }
-  char *symtab = NULL;
-  int symcount = 0;
-  int symentsize = 0;
-  char *strtab = NULL;
-  g_debug("ELF header: %s", header->e_ident);
-  for (int i = 0; i < header->e_shnum; i++) {
-    ElfW(Shdr) *section = &sections[i];
-    const char *name = shstrbuf + section->sh_name;
-    if (!name) {
+  for (size_t written = 0; written < json.length;) {
+    ssize_t result = write(fd, json.data + written, json.length - written);
+    if (result < 0 && errno == EINTR) {
       continue;
     }
-    if (strcmp(name, ".symtab") == 0) {
-      symtab = malloc(section->sh_size);
-      fseek(f, section->sh_offset, SEEK_SET);
-      if (fread(symtab, section->sh_size, 1, f) != 1) {
-        g_debug("couldn't load symbol table: %s", strerror(errno));
-        return;
-      }
-      symcount = section->sh_size / section->sh_entsize;
-      symentsize = section->sh_entsize;
-    } else if (strcmp(name, ".strtab") == 0) {
-      strtab = malloc(section->sh_size);
-      fseek(f, section->sh_offset, SEEK_SET);
-      if (fread(strtab, section->sh_size, 1, f) != 1) {
-        g_debug("couldn't load symbol string table: %s", strerror(errno));
-        return;
-      }
+    if (result <= 0) {
+      break;
     }
+    written += result;
   }
-  fclose(f);
+  close(fd);
+}
 
-  if (!symtab || !strtab) {
-    g_debug("could not locate symtab or strtab table");
+static void init_stats(void) {
+  stats_path = getenv("WLCURSORFIX_STATS");
+  if (!stats_path || !*stats_path) {
+    stats_path = NULL;
     return;
   }
-  for (int i = 0; i < symcount; i++) {
-    ElfW(Sym) *symbol = (void *)((const char *)symtab + symentsize * i);
-    const char *name = strtab + symbol->st_name;
-    if (!*name) {
-      continue;
+  atexit(dump_stats);
+}
+
+//
+// Tracing
+//
+
+// Set WLCURSORFIX_TRACE to a file name ("%p" is replaced with the process ID)
+// to keep a log of what the shim decided about each cursor: which buffers were
+// mapped to which shapes, which set_cursor requests were deferred, mapped or
+// flushed. Events are recorded in binary form into a small ring per thread,
+// which costs about as much as a counter, and only rendered as text when the
+// log is written out, at exit and on WLCURSORFIX_STATS_SIGNAL. With tracing
+// off, each trace point is a single branch on a flag that never changes; the
+// trace build option compiles them out entirely.
+
+#ifndef WLCURSORFIX_TRACE
+#define WLCURSORFIX_TRACE 1
+#endif
+
+// Fields an event carries, for the decoder
+#define TRACE_PROXY (1 << 0)
+#define TRACE_BUFFER (1 << 1)
+#define TRACE_SHAPE (1 << 2)
+
+#define TRACE_EVENTS(X)                                                        \
+  X(cursor_registered, TRACE_PROXY | TRACE_SHAPE)                              \
+  X(cursor_unknown, TRACE_PROXY)                                               \
+  X(buffer_registered, TRACE_BUFFER | TRACE_SHAPE)                             \
+  X(buffer_looked_up, TRACE_BUFFER | TRACE_SHAPE)                              \
+  X(gtk_buffer_registered, TRACE_BUFFER | TRACE_SHAPE)                         \
+  X(pixels_matched, TRACE_BUFFER | TRACE_SHAPE)                                \
+  X(pixels_unmatched, TRACE_BUFFER)                                            \
+  X(set_cursor_deferred, TRACE_PROXY)                                          \
+  X(set_cursor_memo_hit, TRACE_PROXY | TRACE_SHAPE)                            \
+  X(set_cursor_flushed, TRACE_PROXY)                                           \
+  X(attach_mapped, TRACE_PROXY | TRACE_BUFFER | TRACE_SHAPE)                   \
+  X(attach_unmapped, TRACE_PROXY | TRACE_BUFFER)
+
+enum trace_event_id {
+#define TRACE_ENUM(name, fields) TRACE_##name,
+  TRACE_EVENTS(TRACE_ENUM)
+#undef TRACE_ENUM
+      TRACE_EVENT_COUNT,
+};
+
+static const struct {
+  const char *name;
+  unsigned int fields;
+} trace_event_info[TRACE_EVENT_COUNT] = {
+#define TRACE_INFO(name, fields) {#name, fields},
+    TRACE_EVENTS(TRACE_INFO)
+#undef TRACE_INFO
+};
+
+#define TRACE_RING_SIZE 1024
+
+struct trace_event {
+  uint64_t time_ns;
+  uint32_t id;
+  uint32_t shape;
+  const void *proxy;
+  const void *buffer;
+};
+
+static const char *trace_path;
+static bool trace_enabled;
+
+static void trace_event(enum trace_event_id id, const void *proxy,
+                        const void *buffer, unsigned int shape) {
+  struct thread_state *state = thread_state();
+  if (!state->trace) {
+    state->trace = calloc(TRACE_RING_SIZE, sizeof(*state->trace));
+    if (!state->trace) {
+      return;
+    }
+  }
+  // Single writer, like the counters.
+  uint64_t head =
+      atomic_load_explicit(&state->trace_head, memory_order_relaxed);
+  state->trace[head % TRACE_RING_SIZE] = (struct trace_event){
+      .time_ns = monotonic_ns(),
+      .id = id,
+      .shape = shape,
+      .proxy = proxy,
+      .buffer = buffer,
+  };
+  atomic_store_explicit(&state->trace_head, head + 1, memory_order_release);
+}
+
+#if WLCURSORFIX_TRACE
+#define TRACE(event, proxy, buffer, shape)                                     \
+  do {                                                                         \
+    if (__builtin_expect(trace_enabled, 0)) {                                  \
+      trace_event(TRACE_##event, proxy, buffer, shape);                        \
+    }                                                                          \
+  } while (0)
+#else
+#define TRACE(event, proxy, buffer, shape)                                     \
+  do {                                                                         \
+  } while (0)
+#endif
+
+static void stats_append_hex(struct stats_buffer *buffer, uintptr_t value) {
+  char digits[2 * sizeof(value) + 3];
+  size_t i = sizeof(digits) - 1;
+  digits[i] = '\0';
+  do {
+    digits[--i] = "0123456789abcdef"[value & 0xf];
+    value >>= 4;
+  } while (value);
+  digits[--i] = 'x';
+  digits[--i] = '0';
+  stats_append(buffer, &digits[i]);
+}
+
+static void trace_write(int fd, const struct stats_buffer *line) {
+  for (size_t written = 0; written < line->length;) {
+    ssize_t result = write(fd, line->data + written, line->length - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return;
+    }
+    written += result;
+  }
+}
+
+// Render every thread's ring, merged in time order. Like dump_stats, this only
+// uses async-signal-safe calls.
+static void dump_trace(void) {
+  if (!trace_enabled) {
+    return;
+  }
+  struct stats_buffer path = {.length = 0};
+  expand_pid_path(&path, trace_path);
+  int fd = open(path.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  // Position of each thread in its ring, as the number of events behind its
+  // head. Threads beyond the first few dozen are left out.
+  struct thread_state *states[64];
+  uint64_t next[64];
+  unsigned int count = 0;
+  for (struct thread_state *state = atomic_load(&thread_states);
+       state && count < 64; state = state->next) {
+    uint64_t head =
+        atomic_load_explicit(&state->trace_head, memory_order_acquire);
+    if (!state->trace || head == 0) {
+      continue;
+    }
+    states[count] = state;
+    next[count] = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    count++;
+  }
+  for (;;) {
+    const struct trace_event *event = NULL;
+    unsigned int thread = 0;
+    for (unsigned int i = 0; i < count; i++) {
+      if (next[i] ==
+          atomic_load_explicit(&states[i]->trace_head, memory_order_acquire)) {
+        continue;
+      }
+      const struct trace_event *candidate =
+          &states[i]->trace[next[i] % TRACE_RING_SIZE];
+      if (!event || candidate->time_ns < event->time_ns) {
+        event = candidate;
+        thread = i;
+      }
+    }
+    if (!event) {
+      break;
+    }
+    next[thread]++;
+    if (event->id >= TRACE_EVENT_COUNT) {
+      continue;
+    }
+    unsigned int fields = trace_event_info[event->id].fields;
+    struct stats_buffer line = {.length = 0};
+    stats_append_u64(&line, event->time_ns);
+    stats_append(&line, " thread ");
+    stats_append_u64(&line, thread);
+    stats_append(&line, " ");
+    stats_append(&line, trace_event_info[event->id].name);
+    if (fields & TRACE_PROXY) {
+      stats_append(&line, " proxy=");
+      stats_append_hex(&line, (uintptr_t)event->proxy);
+    }
+    if (fields & TRACE_BUFFER) {
+      stats_append(&line, " buffer=");
+      stats_append_hex(&line, (uintptr_t)event->buffer);
+    }
+    if (fields & TRACE_SHAPE) {
+      stats_append(&line, " shape=");
+      stats_append_u64(&line, event->shape);
+    }
+    stats_append(&line, "\n");
+    trace_write(fd, &line);
+  }
+  close(fd);
+}
+
+static void init_trace(void) {
+  trace_path = getenv("WLCURSORFIX_TRACE");
+  if (!WLCURSORFIX_TRACE || !trace_path || !*trace_path) {
+    return;
+  }
+  trace_enabled = true;
+  atexit(dump_trace);
+}
+
+static void handle_dump_signal(int signal) {
+  int saved_errno = errno;
+  dump_stats();
+  dump_trace();
+  errno = saved_errno;
+}
+
+// Dump counters and the trace on WLCURSORFIX_STATS_SIGNAL, if either is on.
+static void init_dump_signal(void) {
+  if (!stats_path && !trace_enabled) {
+    return;
+  }
+  int signal = SIGUSR2;
+  const char *signal_env = getenv("WLCURSORFIX_STATS_SIGNAL");
+  if (signal_env && *signal_env) {
+    signal = atoi(signal_env);
+  }
+  // Don't take the signal away from an application that handles it itself.
+  struct sigaction old_action;
+  if (signal <= 0 || sigaction(signal, NULL, &old_action) < 0 ||
+      old_action.sa_handler != SIG_DFL) {
+    return;
+  }
+  struct sigaction action = {.sa_handler = handle_dump_signal,
+                             .sa_flags = SA_RESTART};
+  sigemptyset(&action.sa_mask);
+  sigaction(signal, &action, NULL);
+}
+
+// Marks a buffer that is known not to correspond to any shape.
+#define SHAPE_NONE UINT_MAX
+
+// 32-bit FNV-1a with the seed mixed into the offset basis. Must match fnv1a()
+// in gen-cursor-shape-table.py.
+static inline uint32_t cursor_name_hash(uint32_t seed, const char *name) {
+  uint32_t hash = 0x811c9dc5u ^ seed;
+  for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+    hash ^= *c;
+    hash *= 0x01000193u;
+  }
+  return hash;
+}
+
+// Get the shape for a cursor name, or SHAPE_NONE if there is none.
+static unsigned int cursor_name_shape(const char *name) {
+  uint32_t displacement =
+      cursor_shape_displacements[cursor_name_hash(0, name) %
+                                 CURSOR_SHAPE_BUCKET_COUNT];
+  const struct cursor_shape_entry *entry =
+      &cursor_shape_table[cursor_name_hash(displacement, name) &
+                          (CURSOR_SHAPE_TABLE_SIZE - 1)];
+  if (!entry->name || strcmp(entry->name, name) != 0) {
+    return SHAPE_NONE;
+  }
+  return entry->shape;
+}
+
+//
+// Cursor name aliases
+//
+
+// Xcursor themes ship many more names than cursor-names.txt can list, as
+// symlinks to a handful of actual cursor files. wlcursorfix-alias-index
+// resolves those symlinks ahead of time and writes the names it could tie to
+// a shape to a binary index, which we map and search here. The index is
+// looked for at WLCURSORFIX_ALIAS_INDEX, or else in the cache directory, and
+// is only consulted for names the built-in table doesn't know.
+//
+// The file is a header, then count entries sorted by name, then the names
+// themselves, NUL-terminated. Must match alias-index.c.
+
+#define ALIAS_INDEX_MAGIC "WLCFALI1"
+
+struct alias_index_header {
+  char magic[8];
+  uint32_t count;
+  uint32_t strings_size;
+};
+
+struct alias_index_entry {
+  // Offset of the name in the string table
+  uint32_t name;
+  uint32_t shape;
+};
+
+static struct {
+  const struct alias_index_entry *entries;
+  const char *strings;
+  uint32_t count;
+  uint32_t strings_size;
+} alias_index;
+
+// Path of a file in our cache directory, creating the directory if needed.
+static bool cache_path(char *path, size_t size, const char *file,
+                       bool create) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int length;
+  if (cache_home && *cache_home) {
+    length = snprintf(path, size, "%s/wlcursorfix", cache_home);
+  } else if (home && *home) {
+    if (create) {
+      snprintf(path, size, "%s/.cache", home);
+      mkdir(path, 0755);
+    }
+    length = snprintf(path, size, "%s/.cache/wlcursorfix", home);
+  } else {
+    return false;
+  }
+  if (length < 0 || length >= size) {
+    return false;
+  }
+  if (create) {
+    mkdir(path, 0755);
+  }
+  return snprintf(path + length, size - length, "/%s", file) < size - length;
+}
+
+static void load_alias_index(void) {
+  char path[PATH_MAX];
+  const char *env = getenv("WLCURSORFIX_ALIAS_INDEX");
+  if (env && *env) {
+    snprintf(path, sizeof(path), "%s", env);
+  } else if (!cache_path(path, sizeof(path), "aliases", false)) {
+    return;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct alias_index_header)) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+  const struct alias_index_header *header = data;
+  size_t size = st.st_size;
+  size_t entries_size =
+      (size_t)header->count * sizeof(struct alias_index_entry);
+  if (memcmp(header->magic, ALIAS_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      entries_size > size - sizeof(*header) ||
+      header->strings_size != size - sizeof(*header) - entries_size ||
+      (header->strings_size > 0 && ((const char *)data)[size - 1] != '\0')) {
+    log_debug("ignoring malformed alias index %s", path);
+    munmap(data, size);
+    return;
+  }
+  alias_index.entries = (const struct alias_index_entry *)(header + 1);
+  alias_index.strings = (const char *)(alias_index.entries + header->count);
+  alias_index.count = header->count;
+  alias_index.strings_size = header->strings_size;
+  log_debug("mapped %u cursor aliases from %s", header->count, path);
+}
+
+// Get the shape for a cursor name from the alias index, or SHAPE_NONE.
+static unsigned int alias_index_shape(const char *name) {
+  static once_flag once = ONCE_FLAG_INIT;
+  call_once(&once, load_alias_index);
+  uint32_t low = 0, high = alias_index.count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    const struct alias_index_entry *entry = &alias_index.entries[middle];
+    if (entry->name >= alias_index.strings_size) {
+      return SHAPE_NONE;
+    }
+    int order = strcmp(name, alias_index.strings + entry->name);
+    if (order == 0) {
+      return entry->shape > 0 &&
+                     entry->shape <= WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ZOOM_OUT
+                 ? entry->shape
+                 : SHAPE_NONE;
+    }
+    if (order < 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return SHAPE_NONE;
+}
+
+// Get the shape for a cursor name a theme was asked for, including the
+// theme's own aliases.
+static unsigned int cursor_alias_shape(const char *name) {
+  unsigned int shape = cursor_name_shape(name);
+  if (shape == SHAPE_NONE) {
+    shape = alias_index_shape(name);
+  }
+  return shape;
+}
+
+typedef struct wl_proxy *(*marshal_array_flags_fn)(
+    struct wl_proxy *proxy, uint32_t opcode,
+    const struct wl_interface *interface, uint32_t version, uint32_t flags,
+    union wl_argument *args);
+typedef int (*display_fn)(struct wl_display *display);
+typedef int (*display_queue_fn)(struct wl_display *display,
+                                struct wl_event_queue *queue);
+
+// The functions we interpose, as found further down the lookup chain. The
+// Wayland libraries are our own dependencies, so they are always loaded by the
+// time init resolves these. GTK may be loaded later on, so its
+// functions are looked up again once one of our GTK hooks runs.
+static struct {
+  marshal_array_flags_fn wl_proxy_marshal_array_flags;
+  int (*wl_proxy_add_listener)(struct wl_proxy *proxy,
+                               void (**implementation)(void), void *data);
+  void (*wl_proxy_destroy)(struct wl_proxy *proxy);
+  display_fn wl_display_flush;
+  display_fn wl_display_dispatch;
+  display_queue_fn wl_display_dispatch_queue;
+  display_fn wl_display_dispatch_pending;
+  display_queue_fn wl_display_dispatch_queue_pending;
+  display_fn wl_display_roundtrip;
+  display_queue_fn wl_display_roundtrip_queue;
+  display_fn wl_display_prepare_read;
+  display_queue_fn wl_display_prepare_read_queue;
+  void (*wl_display_disconnect)(struct wl_display *display);
+  struct wl_cursor_theme *(*wl_cursor_theme_load)(const char *name, int size,
+                                                  struct wl_shm *shm);
+  void (*wl_cursor_theme_destroy)(struct wl_cursor_theme *theme);
+  struct wl_cursor *(*wl_cursor_theme_get_cursor)(struct wl_cursor_theme *theme,
+                                                  const char *name);
+  int (*wl_cursor_frame_and_duration)(struct wl_cursor *cursor, uint32_t time,
+                                      uint32_t *duration);
+  int (*wl_cursor_frame)(struct wl_cursor *cursor, uint32_t time);
+  struct wl_buffer *(*wl_cursor_image_get_buffer)(
+      struct wl_cursor_image *image);
+  int (*g_application_run)(void *application, int argc, char **argv);
+  void (*gtk_init)(void *argc, void *argv);
+} real;
+
+#define RESOLVE_REAL(symbol) real.symbol = dlsym(RTLD_NEXT, #symbol)
+
+static void resolve_real_functions(void) {
+  RESOLVE_REAL(wl_proxy_marshal_array_flags);
+  RESOLVE_REAL(wl_proxy_add_listener);
+  RESOLVE_REAL(wl_proxy_destroy);
+  RESOLVE_REAL(wl_display_flush);
+  RESOLVE_REAL(wl_display_dispatch);
+  RESOLVE_REAL(wl_display_dispatch_queue);
+  RESOLVE_REAL(wl_display_dispatch_pending);
+  RESOLVE_REAL(wl_display_dispatch_queue_pending);
+  RESOLVE_REAL(wl_display_roundtrip);
+  RESOLVE_REAL(wl_display_roundtrip_queue);
+  RESOLVE_REAL(wl_display_prepare_read);
+  RESOLVE_REAL(wl_display_prepare_read_queue);
+  RESOLVE_REAL(wl_display_disconnect);
+  RESOLVE_REAL(wl_cursor_theme_load);
+  RESOLVE_REAL(wl_cursor_theme_destroy);
+  RESOLVE_REAL(wl_cursor_theme_get_cursor);
+  RESOLVE_REAL(wl_cursor_frame_and_duration);
+  RESOLVE_REAL(wl_cursor_frame);
+  RESOLVE_REAL(wl_cursor_image_get_buffer);
+  RESOLVE_REAL(g_application_run);
+  RESOLVE_REAL(gtk_init);
+}
+
+// The marshal hook proper, and what we swap in for it while no display has a
+// cursor shape manager; see "Pass-through mode".
+static struct wl_proxy *marshal_hook(struct wl_proxy *proxy, uint32_t opcode,
+                                     const struct wl_interface *interface,
+                                     uint32_t version, uint32_t flags,
+                                     union wl_argument *args);
+static struct wl_proxy *
+marshal_passthrough(struct wl_proxy *proxy, uint32_t opcode,
+                    const struct wl_interface *interface, uint32_t version,
+                    uint32_t flags, union wl_argument *args);
+static struct wl_proxy *
+marshal_bootstrap(struct wl_proxy *proxy, uint32_t opcode,
+                  const struct wl_interface *interface, uint32_t version,
+                  uint32_t flags, union wl_argument *args);
+
+// What wl_proxy_marshal_array_flags calls. marshal_bootstrap until the first
+// request initializes the shim; after that, it only changes under mutex,
+// between marshal_armed and marshal_passthrough.
+static _Atomic(marshal_array_flags_fn) marshal_impl = marshal_bootstrap;
+// marshal_hook, or marshal_capture when capturing requests. Set once by init.
+static marshal_array_flags_fn marshal_armed = marshal_hook;
+
+static mtx_t mutex;
+
+// Map of wl_buffer -> shape, or SHAPE_NONE for buffers whose pixels were
+// found not to be a cursor we know
+static struct lf_map buffer_shape_map;
+// Bumped whenever an existing buffer_shape_map entry changes or goes away, so
+// that thread-local caches in front of it can be invalidated.
+static _Atomic uint64_t buffer_shape_generation = 1;
+// Set of placeholder wl_cursor_themes handed out in no-pixels mode
+static struct lf_map placeholder_themes;
+// Map of wl_display -> display_context
+static struct lf_map display_contexts;
+// Map of wl_pointer or zwp_tablet_tool_v2 -> cursor_shape_device, across all
+// displays
+static struct lf_map shape_devices;
+// Number of cursor shape managers bound across all displays
+static atomic_uint cursor_shape_manager_count;
+// Set with WLCURSORFIX_COALESCE. Toolkits can change the cursor several times
+// while handling one batch of events, say when the pointer crosses nested
+// widgets, and only the last change is ever seen. In this mode, set_shape is
+// held on the device and only the latest one is sent, once the application
+// flushes or dispatches.
+static bool coalesce_shapes;
+// Map of wl_cursor -> wl_cursor_theme, for cursors that map to a shape
+static struct lf_map shape_cursors;
+// Map of wl_cursor -> wl_cursor_theme, for every cursor whose buffers were
+// registered, whether or not its name maps to a shape
+static struct lf_map registered_cursors;
+// Map of wp_viewport and wp_fractional_scale_v1 -> the wl_surface they extend
+static struct lf_map surface_addons;
+// Map of cursor wl_surface -> the shape its last attached buffer mapped to
+static struct lf_map surface_shapes;
+// Boolean that is set to true inside gtk_init
+static atomic_bool in_gtk_init = false;
+// Captured GdkWaylandDisplay from gtk_init call
+static void *_Atomic gdk_wayland_display;
+// Whether the resident GTK is GTK4 and we resolved its private symbols
+static atomic_bool have_gtk4 = false;
+// Guards shm_pools and shm_buffers
+static mtx_t shm_lock;
+// Map of wl_shm_pool -> shm_pool, for pools small enough to hold cursors
+static struct ptr_map shm_pools = PTR_MAP_INIT;
+// Map of wl_buffer -> shm_buffer, for buffers created from those pools
+static struct ptr_map shm_buffers = PTR_MAP_INIT;
+// Guards the Xcursor content index
+static mtx_t xcursor_index_lock;
+
+// Initialize global structures. This is not a constructor: a session-wide
+// LD_PRELOAD puts the shim into every process, and most of them never speak
+// Wayland. Instead, each of our Wayland hooks calls ensure_init first, so the
+// work is only done in processes that actually use libwayland-client.
+static void init(void) {
+  mtx_init(&mutex, mtx_plain);
+  mtx_init(&shm_lock, mtx_plain);
+  mtx_init(&xcursor_index_lock, mtx_plain);
+  tss_create(&thread_state_key, release_thread_state);
+  resolve_real_functions();
+  init_stats();
+  init_trace();
+  init_dump_signal();
+  init_capture();
+  lf_map_init(&buffer_shape_map);
+  lf_map_init(&placeholder_themes);
+  lf_map_init(&shape_cursors);
+  lf_map_init(&registered_cursors);
+  lf_map_init(&surface_addons);
+  lf_map_init(&surface_shapes);
+  lf_map_init(&shape_devices);
+  lf_map_init(&display_contexts);
+  const char *coalesce = getenv("WLCURSORFIX_COALESCE");
+  coalesce_shapes = coalesce && *coalesce && strcmp(coalesce, "0") != 0;
+  gdk_wayland_display = NULL;
+  log_debug("wlcursorfix initialized");
+}
+
+static once_flag init_flag = ONCE_FLAG_INIT;
+
+static inline void ensure_init(void) { call_once(&init_flag, init); }
+
+// Record shape for buffer in buffer_shape_map
+static void store_buffer_shape(struct wl_buffer *buffer, unsigned int shape) {
+  uintptr_t previous = lf_map_insert(&buffer_shape_map, buffer, shape);
+  if (previous != 0 && previous != shape) {
+    atomic_fetch_add(&buffer_shape_generation, 1);
+  }
+}
+
+// Drop a buffer that is being destroyed from buffer_shape_map. Its address may
+// be reused for an unrelated buffer later.
+static void forget_buffer_shape(struct wl_buffer *buffer) {
+  if (lf_map_lookup(&buffer_shape_map, buffer) != 0) {
+    lf_map_remove(&buffer_shape_map, buffer);
+    atomic_fetch_add(&buffer_shape_generation, 1);
+  }
+  if (have_gtk4) {
+    gtk_theme_index_forget_buffer(buffer);
+  }
+}
+
+// Register wl_cursor buffers for the corresponding shape to name
+static void register_wl_cursor_buffers(struct wl_cursor_theme *theme,
+                                       const char *name,
+                                       struct wl_cursor *cursor) {
+  unsigned int shape = cursor_alias_shape(name);
+  if (shape == SHAPE_NONE) {
+    TRACE(cursor_unknown, cursor, NULL, 0);
+    return;
+  }
+  TRACE(cursor_registered, cursor, NULL, shape);
+  for (int i = 0; i < cursor->image_count; i++) {
+    struct wl_buffer *buffer = wl_cursor_image_get_buffer(cursor->images[i]);
+    TRACE(buffer_registered, NULL, buffer, shape);
+    store_buffer_shape(buffer, shape);
+  }
+  lf_map_insert(&shape_cursors, cursor, (uintptr_t)theme);
+}
+
+// Small per-thread cache of recent buffer_shape_map hits. Applications tend to
+// flip between a handful of cursors, so this catches most lookups.
+#define BUFFER_SHAPE_CACHE_SIZE 16
+
+static thread_local struct {
+  struct wl_buffer *buffer;
+  unsigned int shape;
+  uint64_t generation;
+} buffer_shape_cache[BUFFER_SHAPE_CACHE_SIZE];
+
+// Look up shape that corresponds to buffer
+static unsigned int lookup_buffer_shape(struct wl_buffer *buffer) {
+  if (!buffer) {
+    return 0;
+  }
+  uint64_t generation =
+      atomic_load_explicit(&buffer_shape_generation, memory_order_acquire);
+  size_t slot = pointer_hash((uintptr_t)buffer) & (BUFFER_SHAPE_CACHE_SIZE - 1);
+  if (buffer_shape_cache[slot].buffer == buffer &&
+      buffer_shape_cache[slot].generation == generation) {
+    stat_add(STAT_buffer_map_hits, 1);
+    return buffer_shape_cache[slot].shape;
+  }
+  uintptr_t known = lf_map_lookup(&buffer_shape_map, buffer);
+  unsigned int shape = known == SHAPE_NONE ? 0 : known;
+  stat_add(shape ? STAT_buffer_map_hits : STAT_buffer_map_misses, 1);
+  if (!shape && gdk_wayland_display) {
+    // GTK4: Try searching the current GTK cursor theme
+    shape =
+        gdk_wayland_display_cursor_buffer_shape(gdk_wayland_display, buffer);
+  }
+  if (!shape && known == 0) {
+    // Last resort: match the pixels against the Xcursor theme. This is only
+    // ever tried once per buffer; the outcome is memoized either way.
+    shape = shm_buffer_content_shape(buffer);
+  }
+  TRACE(buffer_looked_up, NULL, buffer, shape);
+  if (shape) {
+    buffer_shape_cache[slot].buffer = buffer;
+    buffer_shape_cache[slot].shape = shape;
+    buffer_shape_cache[slot].generation = generation;
+  }
+  return shape;
+}
+
+// Everything we keep for one wl_display connection: its cursor shape manager
+// and the shape devices created from it. Created when we first see the display
+// and freed in one go by wl_display_disconnect.
+struct display_context {
+  struct wl_display *display;
+  // Set once, when the registry announces the global
+  struct wp_cursor_shape_manager_v1 *_Atomic manager;
+  // Guards pending and devices, and the manager being set, so that a device
+  // can't slip between the manager check and the pending list.
+  mtx_t lock;
+  // Pointers and tablet tools that appeared before the manager was bound
+  struct pending_shape_device *pending;
+  // Every device created for the display
+  struct cursor_shape_device *devices;
+  // Whether any device has a pending_shape
+  atomic_bool shapes_pending;
+};
+
+// A pointer or tablet tool that appeared before its display's cursor shape
+// manager was bound. Its device is created once the manager shows up.
+struct pending_shape_device {
+  struct wl_proxy *object;
+  bool tablet_tool;
+  struct pending_shape_device *next;
+};
+
+// The context of a display, if it has one yet
+static inline struct display_context *
+get_display_context(struct wl_display *display) {
+  return (struct display_context *)lf_map_lookup(&display_contexts, display);
+}
+
+// The context of a display, created on first use
+static struct display_context *
+ensure_display_context(struct wl_display *display) {
+  struct display_context *context = get_display_context(display);
+  if (context) {
+    return context;
+  }
+  lock_mutex(&mutex);
+  context = get_display_context(display);
+  if (!context) {
+    context = calloc(1, sizeof(*context));
+    if (context) {
+      context->display = display;
+      mtx_init(&context->lock, mtx_plain);
+      lf_map_insert(&display_contexts, display, (uintptr_t)context);
+    }
+  }
+  mtx_unlock(&mutex);
+  return context;
+}
+
+static void create_cursor_shape_device(
+    struct display_context *context,
+    struct wp_cursor_shape_manager_v1 *cursor_shape_manager,
+    struct wl_proxy *object, bool tablet_tool) {
+  struct wp_cursor_shape_device_v1 *device;
+  if (tablet_tool) {
+    device = wp_cursor_shape_manager_v1_get_tablet_tool_v2(
+        cursor_shape_manager, (struct zwp_tablet_tool_v2 *)object);
+  } else {
+    device = wp_cursor_shape_manager_v1_get_pointer(
+        cursor_shape_manager, (struct wl_pointer *)object);
+  }
+  if (!device) {
+    return;
+  }
+  struct cursor_shape_device *cursor_shape_device =
+      calloc(1, sizeof(*cursor_shape_device));
+  if (!cursor_shape_device) {
+    wp_cursor_shape_device_v1_destroy(device);
+    return;
+  }
+  cursor_shape_device->device = device;
+  cursor_shape_device->object = object;
+  cursor_shape_device->context = context;
+  log_debug("created cursor shape device %p for %p", device, object);
+  lock_mutex(&context->lock);
+  cursor_shape_device->next = context->devices;
+  context->devices = cursor_shape_device;
+  mtx_unlock(&context->lock);
+  lf_map_insert(&shape_devices, object, (uintptr_t)cursor_shape_device);
+  stat_add(STAT_shape_devices_created, 1);
+}
+
+// Called as soon as a pointer or tablet tool exists, so that the device is
+// ready by the time the first set_cursor comes in. If the display has no
+// cursor shape manager yet, the object waits for it.
+static void watch_cursor_shape_device(struct wl_proxy *object,
+                                      bool tablet_tool) {
+  struct display_context *context = ensure_display_context(object->display);
+  if (!context) {
+    return;
+  }
+  lock_mutex(&context->lock);
+  struct wp_cursor_shape_manager_v1 *cursor_shape_manager =
+      atomic_load(&context->manager);
+  if (!cursor_shape_manager) {
+    struct pending_shape_device *pending = malloc(sizeof(*pending));
+    if (pending) {
+      pending->object = object;
+      pending->tablet_tool = tablet_tool;
+      pending->next = context->pending;
+      context->pending = pending;
+    }
+    mtx_unlock(&context->lock);
+    return;
+  }
+  mtx_unlock(&context->lock);
+  create_cursor_shape_device(context, cursor_shape_manager, object,
+                             tablet_tool);
+}
+
+// Register the shape manager for display, and create the devices of the
+// pointers and tablet tools that were waiting for it
+static void register_display_shape_manager(
+    struct wl_display *display,
+    struct wp_cursor_shape_manager_v1 *cursor_shape_manager) {
+  struct display_context *context = ensure_display_context(display);
+  if (!context) {
+    return;
+  }
+  lock_mutex(&context->lock);
+  if (atomic_load(&context->manager)) {
+    mtx_unlock(&context->lock);
+    return;
+  }
+  atomic_store(&context->manager, cursor_shape_manager);
+  struct pending_shape_device *ready = context->pending;
+  context->pending = NULL;
+  mtx_unlock(&context->lock);
+
+  lock_mutex(&mutex);
+  atomic_fetch_add(&cursor_shape_manager_count, 1);
+  if (atomic_exchange(&marshal_impl, marshal_armed) != marshal_armed) {
+    log_debug("cursor shape manager appeared, hooking requests again");
+  }
+  mtx_unlock(&mutex);
+
+  while (ready) {
+    struct pending_shape_device *pending = ready;
+    ready = pending->next;
+    create_cursor_shape_device(context, cursor_shape_manager, pending->object,
+                               pending->tablet_tool);
+    free(pending);
+  }
+}
+
+// Whether a cursor shape manager was bound for display
+static bool display_has_cursor_shape_manager(struct wl_display *display) {
+  struct display_context *context = get_display_context(display);
+  return context && atomic_load(&context->manager) != NULL;
+}
+
+// The cursor shape device of a pointer or tablet tool, if it has one
+static inline struct cursor_shape_device *
+get_cursor_shape_device(struct wl_proxy *object) {
+  return (struct cursor_shape_device *)lf_map_lookup(&shape_devices, object);
+}
+
+// Set the shape of a device, unless it already has that shape for this serial.
+// Animated cursors re-attach a new buffer for every frame, which would
+// otherwise turn into a stream of identical set_shape requests.
+static void set_cursor_shape(struct cursor_shape_device *cursor_shape_device,
+                             uint32_t serial, unsigned int shape) {
+  uint64_t state = (uint64_t)serial << 32 | shape;
+  if (atomic_exchange(&cursor_shape_device->last_shape, state) == state) {
+    return;
+  }
+  if (coalesce_shapes) {
+    if (atomic_exchange(&cursor_shape_device->pending_shape, state) != 0) {
+      stat_add(STAT_set_shape_coalesced, 1);
+    }
+    atomic_store(&cursor_shape_device->context->shapes_pending, true);
+    return;
+  }
+  wp_cursor_shape_device_v1_set_shape(cursor_shape_device->device, serial,
+                                      shape);
+}
+
+// Send the held set_shape requests of a display's devices.
+static void flush_display_shapes(struct display_context *context) {
+  if (!atomic_exchange(&context->shapes_pending, false)) {
+    return;
+  }
+  lock_mutex(&context->lock);
+  for (struct cursor_shape_device *cursor_shape_device = context->devices;
+       cursor_shape_device; cursor_shape_device = cursor_shape_device->next) {
+    uint64_t state = atomic_exchange(&cursor_shape_device->pending_shape, 0);
+    if (state != 0) {
+      wp_cursor_shape_device_v1_set_shape(cursor_shape_device->device,
+                                          state >> 32, (uint32_t)state);
+    }
+  }
+  mtx_unlock(&context->lock);
+}
+
+static inline void flush_coalesced_shapes(struct wl_display *display) {
+  if (!coalesce_shapes) {
+    return;
+  }
+  struct display_context *context = get_display_context(display);
+  if (context) {
+    flush_display_shapes(context);
+  }
+}
+
+// A set_cursor for object is going out as is, which replaces whatever shape we
+// set on its device, or were about to.
+static void cursor_shape_superseded(struct wl_proxy *object) {
+  struct cursor_shape_device *cursor_shape_device =
+      get_cursor_shape_device(object);
+  if (cursor_shape_device) {
+    atomic_store(&cursor_shape_device->last_shape, 0);
+    atomic_store(&cursor_shape_device->pending_shape, 0);
+  }
+}
+
+// Destroy the cursor shape device we created for a pointer or tablet tool
+static void release_cursor_shape_device(struct wl_proxy *object) {
+  struct cursor_shape_device *cursor_shape_device =
+      (struct cursor_shape_device *)lf_map_remove(&shape_devices, object);
+  if (cursor_shape_device != NULL) {
+    struct display_context *context = cursor_shape_device->context;
+    lock_mutex(&context->lock);
+    for (struct cursor_shape_device **link = &context->devices; *link;
+         link = &(*link)->next) {
+      if (*link == cursor_shape_device) {
+        *link = cursor_shape_device->next;
+        break;
+      }
+    }
+    mtx_unlock(&context->lock);
+    log_debug("destroying cursor shape device %p for %p",
+              cursor_shape_device->device, object);
+    wp_cursor_shape_device_v1_destroy(cursor_shape_device->device);
+    free(cursor_shape_device);
+    return;
+  }
+  struct display_context *context = get_display_context(object->display);
+  if (!context) {
+    return;
+  }
+  lock_mutex(&context->lock);
+  for (struct pending_shape_device **link = &context->pending; *link;
+       link = &(*link)->next) {
+    if ((*link)->object == object) {
+      struct pending_shape_device *pending = *link;
+      *link = pending->next;
+      free(pending);
+      break;
+    }
+  }
+  mtx_unlock(&context->lock);
+}
+
+// Free everything we kept for a display that is being disconnected. Its
+// proxies are only freed locally, since the connection is going away.
+static void release_display_context(struct wl_display *display) {
+  forget_display_deferrals(display);
+  struct display_context *context =
+      (struct display_context *)lf_map_remove(&display_contexts, display);
+  if (!context) {
+    return;
+  }
+  while (context->devices) {
+    struct cursor_shape_device *cursor_shape_device = context->devices;
+    context->devices = cursor_shape_device->next;
+    lf_map_remove(&shape_devices, cursor_shape_device->object);
+    real.wl_proxy_destroy((struct wl_proxy *)cursor_shape_device->device);
+    free(cursor_shape_device);
+  }
+  while (context->pending) {
+    struct pending_shape_device *pending = context->pending;
+    context->pending = pending->next;
+    free(pending);
+  }
+  struct wp_cursor_shape_manager_v1 *manager = atomic_load(&context->manager);
+  if (manager) {
+    real.wl_proxy_destroy((struct wl_proxy *)manager);
+    atomic_fetch_sub(&cursor_shape_manager_count, 1);
+  }
+  log_debug("released context of display %p", display);
+  mtx_destroy(&context->lock);
+  free(context);
+}
+
+//
+// Shm buffer tracking
+//
+
+// Toolkits that rasterize Xcursor images themselves (or load libwayland-cursor
+// behind our back with dlopen) hand us buffers we have never seen. To still
+// recognize those, we keep a read-only mapping of every small wl_shm_pool and
+// remember where each buffer created from it lives, so that the pixels of an
+// unknown cursor buffer can be matched against the Xcursor theme.
+
+// Cursor pools are tiny; anything bigger than this is window content.
+#define MAX_SHM_POOL_SIZE (1 << 20)
+// Largest cursor image we try to identify.
+#define MAX_CURSOR_IMAGE_SIZE 256
+
+// A mapping of a wl_shm_pool, referenced by the pool proxy and by every buffer
+// created from it. Buffers can outlive their pool proxy.
+struct shm_pool {
+  unsigned int refs;
+  const unsigned char *data;
+  size_t size;
+};
+
+struct shm_buffer {
+  struct shm_pool *pool;
+  int32_t offset, width, height, stride;
+};
+
+static void shm_pool_unref(struct shm_pool *pool) {
+  if (--pool->refs == 0) {
+    munmap((void *)pool->data, pool->size);
+    free(pool);
+  }
+}
+
+// Map a pool that was just created, if it is small enough to hold cursors.
+static void track_shm_pool(struct wl_proxy *proxy, int fd, int32_t size) {
+  if (!proxy || size <= 0 || size > MAX_SHM_POOL_SIZE) {
+    return;
+  }
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    log_debug("couldn't map shm pool %p: %s", proxy, strerror(errno));
+    return;
+  }
+  struct shm_pool *pool = malloc(sizeof(*pool));
+  if (!pool) {
+    munmap(data, size);
+    return;
+  }
+  pool->refs = 1;
+  pool->data = data;
+  pool->size = size;
+  lock_mutex(&shm_lock);
+  if (!ptr_map_insert(&shm_pools, proxy, (uintptr_t)pool)) {
+    shm_pool_unref(pool);
+  }
+  mtx_unlock(&shm_lock);
+}
+
+// Remember where a buffer lives, if it could be a cursor image we can read.
+// Buffers that reach past our mapping (e.g. after wl_shm_pool.resize, which we
+// don't follow) are skipped.
+static void track_shm_buffer(struct wl_proxy *pool_proxy,
+                             struct wl_proxy *proxy, int32_t offset,
+                             int32_t width, int32_t height, int32_t stride,
+                             uint32_t format) {
+  if (!proxy || format != WL_SHM_FORMAT_ARGB8888 || width <= 0 ||
+      height <= 0 || width > MAX_CURSOR_IMAGE_SIZE ||
+      height > MAX_CURSOR_IMAGE_SIZE || offset < 0 || stride < width * 4) {
+    return;
+  }
+  lock_mutex(&shm_lock);
+  struct shm_pool *pool =
+      (struct shm_pool *)ptr_map_lookup(&shm_pools, pool_proxy);
+  struct shm_buffer *buffer;
+  if (pool &&
+      (size_t)offset + (size_t)stride * (height - 1) + (size_t)width * 4 <=
+          pool->size &&
+      (buffer = malloc(sizeof(*buffer)))) {
+    *buffer = (struct shm_buffer){pool, offset, width, height, stride};
+    if (ptr_map_insert(&shm_buffers, proxy, (uintptr_t)buffer)) {
+      pool->refs++;
+    } else {
+      free(buffer);
+    }
+  }
+  mtx_unlock(&shm_lock);
+}
+
+static void forget_shm_pool(struct wl_proxy *proxy) {
+  lock_mutex(&shm_lock);
+  struct shm_pool *pool = (struct shm_pool *)ptr_map_remove(&shm_pools, proxy);
+  if (pool) {
+    shm_pool_unref(pool);
+  }
+  mtx_unlock(&shm_lock);
+}
+
+static void forget_shm_buffer(struct wl_proxy *proxy) {
+  lock_mutex(&shm_lock);
+  struct shm_buffer *buffer =
+      (struct shm_buffer *)ptr_map_remove(&shm_buffers, proxy);
+  if (buffer) {
+    shm_pool_unref(buffer->pool);
+    free(buffer);
+  }
+  mtx_unlock(&shm_lock);
+}
+
+// Hash an ARGB8888 image row by row, so that stride padding doesn't matter.
+// Four independent 32-bit lanes are mixed in parallel, which GCC and Clang
+// turn into SSE2 or NEON code, and folded into 64 bits at the end.
+typedef uint32_t pixel_hash_lanes __attribute__((vector_size(16)));
+
+static uint64_t pixel_hash(const unsigned char *pixels, uint32_t width,
+                           uint32_t height, size_t stride) {
+  const pixel_hash_lanes prime = {0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du,
+                                  0x27d4eb2fu};
+  pixel_hash_lanes acc = {width, height, 0x165667b1u, 0xd3a2646cu};
+  size_t row_size = (size_t)width * 4;
+  for (uint32_t y = 0; y < height; y++) {
+    const unsigned char *row = pixels + y * stride;
+    size_t x = 0;
+    for (; x + sizeof(acc) <= row_size; x += sizeof(acc)) {
+      pixel_hash_lanes lanes;
+      memcpy(&lanes, row + x, sizeof(lanes));
+      acc = (acc ^ lanes) * prime;
+      acc ^= acc >> 15;
+    }
+    if (x < row_size) {
+      pixel_hash_lanes lanes = {0};
+      memcpy(&lanes, row + x, row_size - x);
+      acc = (acc ^ lanes) * prime;
+      acc ^= acc >> 15;
+    }
+  }
+  uint64_t hash = ((uint64_t)acc[0] << 32 | acc[1]) * 0x9e3779b97f4a7c15u;
+  hash ^= ((uint64_t)acc[2] << 32 | acc[3]) * 0xc2b2ae3d27d4eb4fu;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+//
+// Xcursor content index
+//
+
+// Hashes of the images in the active Xcursor theme, built lazily for each
+// image width we are asked about and then kept for the life of the process.
+// The theme is the one libXcursor would pick, from XCURSOR_THEME and
+// XCURSOR_PATH, including themes it inherits from.
+
+#define XCURSOR_MAGIC 0x72756358u
+#define XCURSOR_IMAGE_TYPE 0xfffd0002u
+#define XCURSOR_MAX_THEMES 8
+#define XCURSOR_DEFAULT_PATH                                                   \
+  "~/.local/share/icons:~/.icons:/usr/share/icons:/usr/share/pixmaps"
+
+struct xcursor_image_hash {
+  uint64_t hash;
+  unsigned int shape;
+};
+
+struct xcursor_size_index {
+  struct xcursor_size_index *next;
+  uint32_t width;
+  size_t count, capacity;
+  struct xcursor_image_hash *images;
+};
+
+static struct xcursor_size_index *xcursor_size_indexes;
+
+// Call fn for each directory in the Xcursor search path, until it returns
+// true.
+static bool xcursor_for_each_dir(bool (*fn)(const char *dir, void *data),
+                                 void *data) {
+  const char *path = getenv("XCURSOR_PATH");
+  if (!path || !*path) {
+    path = XCURSOR_DEFAULT_PATH;
+  }
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX];
+  while (*path) {
+    size_t length = strcspn(path, ":");
+    int written;
+    if (path[0] == '~' && home) {
+      written = snprintf(dir, sizeof(dir), "%s%.*s", home, (int)length - 1,
+                         path + 1);
+    } else {
+      written = snprintf(dir, sizeof(dir), "%.*s", (int)length, path);
+    }
+    if (length > 0 && written > 0 && written < sizeof(dir) && fn(dir, data)) {
+      return true;
+    }
+    path += length;
+    if (*path == ':') {
+      path++;
+    }
+  }
+  return false;
+}
+
+struct xcursor_theme_chain {
+  char names[XCURSOR_MAX_THEMES][NAME_MAX + 1];
+  int count;
+};
+
+static void xcursor_theme_chain_add(struct xcursor_theme_chain *chain,
+                                    const char *name, size_t length) {
+  if (length == 0 || length > NAME_MAX || memchr(name, '/', length) ||
+      chain->count == XCURSOR_MAX_THEMES) {
+    return;
+  }
+  for (int i = 0; i < chain->count; i++) {
+    if (strlen(chain->names[i]) == length &&
+        memcmp(chain->names[i], name, length) == 0) {
+      return;
+    }
+  }
+  memcpy(chain->names[chain->count], name, length);
+  chain->names[chain->count][length] = '\0';
+  chain->count++;
+}
+
+struct xcursor_inherits_search {
+  struct xcursor_theme_chain *chain;
+  const char *theme;
+};
+
+// Add the themes listed in the first index.theme found for a theme.
+static bool xcursor_read_inherits(const char *dir, void *data) {
+  struct xcursor_inherits_search *search = data;
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s/index.theme", dir, search->theme) >=
+      sizeof(path)) {
+    return false;
+  }
+  FILE *f = fopen(path, "re");
+  if (!f) {
+    return false;
+  }
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "Inherits", 8) != 0) {
+      continue;
+    }
+    const char *value = line + 8 + strspn(line + 8, " \t");
+    if (*value != '=') {
+      continue;
+    }
+    value++;
+    while (*value) {
+      value += strspn(value, " \t,;\n");
+      size_t length = strcspn(value, " \t,;\n");
+      xcursor_theme_chain_add(search->chain, value, length);
+      value += length;
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+static void xcursor_theme_chain_build(struct xcursor_theme_chain *chain) {
+  const char *theme = getenv("XCURSOR_THEME");
+  chain->count = 0;
+  if (theme && *theme) {
+    xcursor_theme_chain_add(chain, theme, strlen(theme));
+  }
+  xcursor_theme_chain_add(chain, "default", strlen("default"));
+  for (int i = 0; i < chain->count; i++) {
+    struct xcursor_inherits_search search = {chain, chain->names[i]};
+    xcursor_for_each_dir(xcursor_read_inherits, &search);
+  }
+}
+
+static void xcursor_size_index_add(struct xcursor_size_index *index,
+                                   uint64_t hash, unsigned int shape) {
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+    struct xcursor_image_hash *images =
+        realloc(index->images, capacity * sizeof(*images));
+    if (!images) {
+      return;
+    }
+    index->images = images;
+    index->capacity = capacity;
+  }
+  index->images[index->count++] = (struct xcursor_image_hash){hash, shape};
+}
+
+static uint32_t xcursor_read_u32(const unsigned char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Hash every image of the index's width in an Xcursor file.
+static void xcursor_index_file(struct xcursor_size_index *index,
+                               const unsigned char *data, size_t size,
+                               unsigned int shape) {
+  if (size < 16 || xcursor_read_u32(data) != XCURSOR_MAGIC) {
+    return;
+  }
+  uint32_t header_size = xcursor_read_u32(data + 4);
+  uint32_t toc_count = xcursor_read_u32(data + 12);
+  if (header_size > size || toc_count > (size - header_size) / 12) {
+    return;
+  }
+  for (uint32_t i = 0; i < toc_count; i++) {
+    const unsigned char *toc = data + header_size + i * 12;
+    uint32_t position = xcursor_read_u32(toc + 8);
+    if (xcursor_read_u32(toc) != XCURSOR_IMAGE_TYPE || position > size ||
+        size - position < 36) {
+      continue;
+    }
+    const unsigned char *chunk = data + position;
+    uint32_t chunk_header_size = xcursor_read_u32(chunk);
+    uint32_t width = xcursor_read_u32(chunk + 16);
+    uint32_t height = xcursor_read_u32(chunk + 20);
+    if (width != index->width || height == 0 ||
+        height > MAX_CURSOR_IMAGE_SIZE || chunk_header_size < 36 ||
+        chunk_header_size > size - position ||
+        (size_t)width * height * 4 > size - position - chunk_header_size) {
+      continue;
+    }
+    xcursor_size_index_add(
+        index, pixel_hash(chunk + chunk_header_size, width, height, width * 4),
+        shape);
+  }
+}
+
+struct xcursor_file_search {
+  const char *theme;
+  const char *name;
+  struct stat st;
+  char path[PATH_MAX];
+};
+
+static bool xcursor_find_file(const char *dir, void *data) {
+  struct xcursor_file_search *search = data;
+  return snprintf(search->path, sizeof(search->path), "%s/%s/cursors/%s", dir,
+                  search->theme, search->name) < sizeof(search->path) &&
+         stat(search->path, &search->st) == 0 && S_ISREG(search->st.st_mode);
+}
+
+static int xcursor_image_hash_compare(const void *a, const void *b) {
+  uint64_t left = ((const struct xcursor_image_hash *)a)->hash;
+  uint64_t right = ((const struct xcursor_image_hash *)b)->hash;
+  return left < right ? -1 : left > right;
+}
+
+// Index the images of every cursor we have a shape for. Theme files are
+// mostly symlinks between aliases, so each file is only read once.
+static struct xcursor_size_index *xcursor_size_index_build(uint32_t width) {
+  struct xcursor_size_index *index = calloc(1, sizeof(*index));
+  if (!index) {
+    return NULL;
+  }
+  index->width = width;
+  struct xcursor_theme_chain chain;
+  xcursor_theme_chain_build(&chain);
+  struct {
+    dev_t dev;
+    ino_t ino;
+  } seen[CURSOR_SHAPE_TABLE_SIZE];
+  size_t seen_count = 0;
+  for (int i = 0; i < CURSOR_SHAPE_TABLE_SIZE; i++) {
+    if (!cursor_shape_table[i].name) {
+      continue;
+    }
+    struct xcursor_file_search search = {.name = cursor_shape_table[i].name};
+    int theme;
+    for (theme = 0; theme < chain.count; theme++) {
+      search.theme = chain.names[theme];
+      if (xcursor_for_each_dir(xcursor_find_file, &search)) {
+        break;
+      }
+    }
+    if (theme == chain.count) {
+      continue;
+    }
+    bool duplicate = false;
+    for (size_t j = 0; j < seen_count; j++) {
+      duplicate |= seen[j].dev == search.st.st_dev &&
+                   seen[j].ino == search.st.st_ino;
+    }
+    if (duplicate) {
+      continue;
+    }
+    seen[seen_count].dev = search.st.st_dev;
+    seen[seen_count].ino = search.st.st_ino;
+    seen_count++;
+    int fd = open(search.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    void *data = search.st.st_size > 0
+                     ? mmap(NULL, search.st.st_size, PROT_READ, MAP_PRIVATE,
+                            fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    if (data != MAP_FAILED) {
+      xcursor_index_file(index, data, search.st.st_size,
+                         cursor_shape_table[i].shape);
+      munmap(data, search.st.st_size);
+    }
+  }
+  qsort(index->images, index->count, sizeof(*index->images),
+        xcursor_image_hash_compare);
+  stat_add(STAT_xcursor_index_builds, 1);
+  log_debug("indexed %zu Xcursor images of width %u from %d themes",
+            index->count, width, chain.count);
+  return index;
+}
+
+// Find the shape of an image by its pixel hash, or SHAPE_NONE.
+static unsigned int xcursor_image_shape(uint32_t width, uint64_t hash) {
+  lock_mutex(&xcursor_index_lock);
+  struct xcursor_size_index *index;
+  for (index = xcursor_size_indexes; index; index = index->next) {
+    if (index->width == width) {
+      break;
+    }
+  }
+  if (!index && (index = xcursor_size_index_build(width))) {
+    index->next = xcursor_size_indexes;
+    xcursor_size_indexes = index;
+  }
+  mtx_unlock(&xcursor_index_lock);
+  if (!index) {
+    return SHAPE_NONE;
+  }
+  // Indexes are never modified once published, so no lock is needed here.
+  struct xcursor_image_hash key = {.hash = hash};
+  struct xcursor_image_hash *image =
+      bsearch(&key, index->images, index->count, sizeof(*index->images),
+              xcursor_image_hash_compare);
+  return image ? image->shape : SHAPE_NONE;
+}
+
+// Identify an unknown shm buffer by its pixels, and memoize the result in
+// buffer_shape_map. Returns 0 if it isn't a cursor image we know. Buffers are
+// assumed not to be redrawn with a different cursor once attached.
+static unsigned int shm_buffer_content_shape(struct wl_buffer *buffer) {
+  lock_mutex(&shm_lock);
+  struct shm_buffer *info =
+      (struct shm_buffer *)ptr_map_lookup(&shm_buffers, buffer);
+  struct shm_buffer copy;
+  if (info) {
+    copy = *info;
+    copy.pool->refs++;
+  }
+  mtx_unlock(&shm_lock);
+  if (!info) {
+    // Not a buffer we can read, so there's no point in asking again.
+    store_buffer_shape(buffer, SHAPE_NONE);
+    return 0;
+  }
+  uint64_t hash = pixel_hash(copy.pool->data + copy.offset, copy.width,
+                             copy.height, copy.stride);
+  unsigned int shape = xcursor_image_shape(copy.width, hash);
+  lock_mutex(&shm_lock);
+  shm_pool_unref(copy.pool);
+  mtx_unlock(&shm_lock);
+  stat_add(STAT_shm_buffers_hashed, 1);
+  store_buffer_shape(buffer, shape);
+  if (shape == SHAPE_NONE) {
+    TRACE(pixels_unmatched, NULL, buffer, 0);
+    return 0;
+  }
+  stat_add(STAT_shm_buffers_matched, 1);
+  TRACE(pixels_matched, NULL, buffer, shape);
+  return shape;
+}
+
+//
+// Request classification
+//
+
+// Every request the application sends passes through our
+// wl_proxy_marshal_array_flags hook, so we avoid string comparisons there.
+// Proxies are classified by their wl_interface pointer; the class for each
+// interface is computed once by name (protocol code generated into the
+// application has its own copy of the interface, so we can't just compare
+// against our own) and cached in a small lock-free table.
+enum proxy_class {
+  PROXY_CLASS_UNKNOWN = 0,
+  PROXY_CLASS_OTHER,
+  PROXY_CLASS_WL_REGISTRY,
+  PROXY_CLASS_WL_BUFFER,
+  PROXY_CLASS_WL_SHM,
+  PROXY_CLASS_WL_SHM_POOL,
+  PROXY_CLASS_WL_SURFACE,
+  PROXY_CLASS_WL_SEAT,
+  PROXY_CLASS_WL_POINTER,
+  PROXY_CLASS_ZWP_TABLET_TOOL_V2,
+  PROXY_CLASS_WP_VIEWPORTER,
+  PROXY_CLASS_WP_VIEWPORT,
+  PROXY_CLASS_WP_FRACTIONAL_SCALE_MANAGER_V1,
+  PROXY_CLASS_WP_FRACTIONAL_SCALE_V1,
+  PROXY_CLASS_COUNT,
+};
+
+const static struct {
+  const char *name;
+  const enum proxy_class class;
+} proxy_class_list[] = {
+    {"wl_registry", PROXY_CLASS_WL_REGISTRY},
+    {"wl_buffer", PROXY_CLASS_WL_BUFFER},
+    {"wl_shm", PROXY_CLASS_WL_SHM},
+    {"wl_shm_pool", PROXY_CLASS_WL_SHM_POOL},
+    {"wl_surface", PROXY_CLASS_WL_SURFACE},
+    {"wl_seat", PROXY_CLASS_WL_SEAT},
+    {"wl_pointer", PROXY_CLASS_WL_POINTER},
+    {"zwp_tablet_tool_v2", PROXY_CLASS_ZWP_TABLET_TOOL_V2},
+    {"wp_viewporter", PROXY_CLASS_WP_VIEWPORTER},
+    {"wp_viewport", PROXY_CLASS_WP_VIEWPORT},
+    {"wp_fractional_scale_manager_v1",
+     PROXY_CLASS_WP_FRACTIONAL_SCALE_MANAGER_V1},
+    {"wp_fractional_scale_v1", PROXY_CLASS_WP_FRACTIONAL_SCALE_V1},
+};
+
+// Applications only ever use a few dozen interfaces. If the cache somehow
+// fills up, we fall back to comparing names.
+#define INTERFACE_CLASS_CACHE_BITS 7
+#define INTERFACE_CLASS_CACHE_SIZE (1 << INTERFACE_CLASS_CACHE_BITS)
+
+static struct {
+  const struct wl_interface *_Atomic interface;
+  _Atomic uint8_t class;
+} interface_class_cache[INTERFACE_CLASS_CACHE_SIZE];
+
+static enum proxy_class
+interface_class_by_name(const struct wl_interface *interface) {
+  for (int i = 0; i < sizeof(proxy_class_list) / sizeof(*proxy_class_list);
+       ++i) {
+    if (strcmp(interface->name, proxy_class_list[i].name) == 0) {
+      return proxy_class_list[i].class;
+    }
+  }
+  return PROXY_CLASS_OTHER;
+}
+
+static enum proxy_class
+interface_class_slow(const struct wl_interface *interface, unsigned int slot) {
+  enum proxy_class class = interface_class_by_name(interface);
+  for (int i = 0; i < INTERFACE_CLASS_CACHE_SIZE; i++) {
+    unsigned int index = (slot + i) & (INTERFACE_CLASS_CACHE_SIZE - 1);
+    const struct wl_interface *expected = NULL;
+    if (atomic_compare_exchange_strong(&interface_class_cache[index].interface,
+                                       &expected, interface)) {
+      // We claimed this slot; readers ignore it until the class is stored.
+      atomic_store_explicit(&interface_class_cache[index].class, class,
+                            memory_order_release);
+      return class;
+    }
+    if (expected == interface) {
+      // Another thread is caching the same interface.
+      return class;
+    }
+  }
+  return class;
+}
+
+static inline enum proxy_class proxy_class(struct wl_proxy *proxy) {
+  const struct wl_interface *interface = proxy->object.interface;
+  unsigned int slot = (unsigned int)(((uint64_t)(uintptr_t)interface *
+                                      UINT64_C(0x9e3779b97f4a7c15)) >>
+                                     (64 - INTERFACE_CLASS_CACHE_BITS));
+  for (int i = 0; i < INTERFACE_CLASS_CACHE_SIZE; i++) {
+    unsigned int index = (slot + i) & (INTERFACE_CLASS_CACHE_SIZE - 1);
+    const struct wl_interface *cached = atomic_load_explicit(
+        &interface_class_cache[index].interface, memory_order_acquire);
+    if (cached == interface) {
+      enum proxy_class class = atomic_load_explicit(
+          &interface_class_cache[index].class, memory_order_acquire);
+      if (class != PROXY_CLASS_UNKNOWN) {
+        return class;
+      }
+      return interface_class_by_name(interface);
+    }
+    if (cached == NULL) {
+      break;
+    }
+  }
+  return interface_class_slow(interface, slot);
+}
+
+// What the marshal hook does with a request, indexed by proxy class and
+// opcode. The opcodes come from the wayland-scanner headers generated from the
+// protocol XML, so this table is resolved entirely at compile time.
+enum request_action {
+  REQUEST_PASS = 0,
+  REQUEST_SET_CURSOR,
+  REQUEST_SEAT_GET_POINTER,
+  REQUEST_SHM_CREATE_POOL,
+  REQUEST_SHM_POOL_CREATE_BUFFER,
+  // Creates a wp_viewport or wp_fractional_scale_v1 for a surface.
+  REQUEST_SURFACE_ADDON_CREATE,
+  // Actions below only apply to the surface of a deferred set_cursor, or to
+  // objects extending it.
+  REQUEST_SURFACE_ADDON_DESTROY,
+  REQUEST_SURFACE_ATTACH,
+  // Double-buffered state that only takes effect on commit.
+  REQUEST_SURFACE_STATE,
+  REQUEST_SURFACE_FRAME,
+  REQUEST_SURFACE_COMMIT,
+};
+
+#define MAX_REQUEST_OPCODE 16
+
+const static uint8_t request_action_table[PROXY_CLASS_COUNT]
+                                         [MAX_REQUEST_OPCODE] = {
+    [PROXY_CLASS_WL_SHM] =
+        {
+            [WL_SHM_CREATE_POOL] = REQUEST_SHM_CREATE_POOL,
+        },
+    [PROXY_CLASS_WL_SHM_POOL] =
+        {
+            [WL_SHM_POOL_CREATE_BUFFER] = REQUEST_SHM_POOL_CREATE_BUFFER,
+        },
+    [PROXY_CLASS_WL_SURFACE] =
+        {
+            [WL_SURFACE_ATTACH] = REQUEST_SURFACE_ATTACH,
+            [WL_SURFACE_DAMAGE] = REQUEST_SURFACE_STATE,
+            [WL_SURFACE_FRAME] = REQUEST_SURFACE_FRAME,
+            [WL_SURFACE_COMMIT] = REQUEST_SURFACE_COMMIT,
+            [WL_SURFACE_SET_BUFFER_TRANSFORM] = REQUEST_SURFACE_STATE,
+            [WL_SURFACE_SET_BUFFER_SCALE] = REQUEST_SURFACE_STATE,
+            [WL_SURFACE_DAMAGE_BUFFER] = REQUEST_SURFACE_STATE,
+            [WL_SURFACE_OFFSET] = REQUEST_SURFACE_STATE,
+        },
+    [PROXY_CLASS_WL_SEAT] =
+        {
+            [WL_SEAT_GET_POINTER] = REQUEST_SEAT_GET_POINTER,
+        },
+    [PROXY_CLASS_WL_POINTER] =
+        {
+            [WL_POINTER_SET_CURSOR] = REQUEST_SET_CURSOR,
+        },
+    [PROXY_CLASS_ZWP_TABLET_TOOL_V2] =
+        {
+            [ZWP_TABLET_TOOL_V2_SET_CURSOR] = REQUEST_SET_CURSOR,
+        },
+    [PROXY_CLASS_WP_VIEWPORTER] =
+        {
+            [WP_VIEWPORTER_GET_VIEWPORT] = REQUEST_SURFACE_ADDON_CREATE,
+        },
+    [PROXY_CLASS_WP_VIEWPORT] =
+        {
+            [WP_VIEWPORT_DESTROY] = REQUEST_SURFACE_ADDON_DESTROY,
+            [WP_VIEWPORT_SET_SOURCE] = REQUEST_SURFACE_STATE,
+            [WP_VIEWPORT_SET_DESTINATION] = REQUEST_SURFACE_STATE,
+        },
+    [PROXY_CLASS_WP_FRACTIONAL_SCALE_MANAGER_V1] =
+        {
+            [WP_FRACTIONAL_SCALE_MANAGER_V1_GET_FRACTIONAL_SCALE] =
+                REQUEST_SURFACE_ADDON_CREATE,
+        },
+    [PROXY_CLASS_WP_FRACTIONAL_SCALE_V1] =
+        {
+            [WP_FRACTIONAL_SCALE_V1_DESTROY] = REQUEST_SURFACE_ADDON_DESTROY,
+        },
+};
+
+static inline enum request_action request_action(enum proxy_class class,
+                                                 uint32_t opcode) {
+  if (opcode >= MAX_REQUEST_OPCODE) {
+    return REQUEST_PASS;
+  }
+  return request_action_table[class][opcode];
+}
+
+//
+// Wayland registry hook
+//
+
+typedef struct {
+  void *data;
+  struct wl_registry_listener *implementation;
+} registry_hook_data;
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+                                   uint32_t id, const char *interface,
+                                   uint32_t version) {
+  registry_hook_data *hook_data = (registry_hook_data *)data;
+  hook_data->implementation->global(hook_data->data, registry, id, interface,
+                                    version);
+  if (strcmp(interface, "wp_cursor_shape_manager_v1") == 0) {
+    struct wl_display *display = ((struct wl_proxy *)registry)->display;
+    log_debug("acquired wp_cursor_shape_manager_v1");
+    register_display_shape_manager(
+        display,
+        wl_registry_bind(registry, id, &wp_cursor_shape_manager_v1_interface,
+                         version < 1 ? version : 1));
+  }
+
+  return;
+}
+
+static void registry_handle_global_remove(void *data,
+                                          struct wl_registry *registry,
+                                          uint32_t id) {
+  registry_hook_data *hook_data = (registry_hook_data *)data;
+  hook_data->implementation->global_remove(hook_data->data, registry, id);
+}
+
+static const struct wl_registry_listener registry_listener = {
+    registry_handle_global,
+    registry_handle_global_remove,
+};
+
+//
+// Request capture
+//
+
+// Set WLCURSORFIX_CAPTURE to a file name ("%p" is replaced with the process
+// ID) to record every request the marshal hook sees into that file, for
+// bench/replay.c to feed through the hook again later. The file is a header
+// followed by a ring of WLCURSORFIX_CAPTURE_RECORDS fixed-size records, mapped
+// shared, so it is complete even if the process is killed. Records hold object
+// IDs rather than pointers; replay recreates the objects it needs.
+
+#define CAPTURE_MAGIC "WLCFCAP1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_DEFAULT_RECORDS 65536
+#define CAPTURE_MAX_ARGS 6
+#define CAPTURE_MAX_CLASSES 32
+#define CAPTURE_CLASS_NAME_SIZE 32
+// Shape of an attached buffer that is known not to be a cursor
+#define CAPTURE_SHAPE_NONE 0xffff
+
+struct capture_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  // Number of records written so far; the ring holds the last capacity ones.
+  _Atomic uint64_t head;
+  // Interface name of each proxy class, so that the trace doesn't depend on
+  // how a particular build numbers them. Empty for PROXY_CLASS_OTHER.
+  char class_names[CAPTURE_MAX_CLASSES][CAPTURE_CLASS_NAME_SIZE];
+};
+
+struct capture_record {
+  uint64_t time_ns;
+  uint32_t object;
+  // Object created by the request, if any
+  uint32_t new_object;
+  // Arguments in signature order: object IDs for objects, 0 for new IDs,
+  // strings and arrays, raw values for everything else.
+  uint32_t args[CAPTURE_MAX_ARGS];
+  uint16_t opcode;
+  uint8_t class;
+  uint8_t new_class;
+  // For wl_surface.attach, what the buffer mapped to after the hook ran: a
+  // shape, CAPTURE_SHAPE_NONE, or 0 if it was never looked up.
+  uint16_t shape;
+  uint8_t flags;
+  uint8_t reserved;
+};
+
+_Static_assert(PROXY_CLASS_COUNT <= CAPTURE_MAX_CLASSES,
+               "capture header can't name every proxy class");
+_Static_assert(sizeof(struct capture_record) == 48,
+               "capture records changed size; bump CAPTURE_VERSION");
+
+static struct capture_header *capture;
+static struct capture_record *capture_records;
+
+static struct wl_proxy *
+marshal_capture(struct wl_proxy *proxy, uint32_t opcode,
+                const struct wl_interface *interface, uint32_t version,
+                uint32_t flags, union wl_argument *args) {
+  const enum proxy_class class = proxy_class(proxy);
+  struct capture_record record = {
+      .time_ns = monotonic_ns(),
+      .object = wl_proxy_get_id(proxy),
+      .opcode = opcode,
+      .class = class,
+      .flags = flags,
+  };
+  const char *signature = proxy->object.interface->methods[opcode].signature;
+  unsigned int arg = 0;
+  for (; *signature && arg < CAPTURE_MAX_ARGS; signature++) {
+    switch (*signature) {
+    case 'o':
+      record.args[arg] =
+          args[arg].o ? wl_proxy_get_id((struct wl_proxy *)args[arg].o) : 0;
+      break;
+    case 'i':
+    case 'u':
+    case 'f':
+    case 'h':
+      record.args[arg] = args[arg].u;
+      break;
+    case 'n':
+    case 's':
+    case 'a':
+      break;
+    default:
+      // Version number or nullability marker
+      continue;
+    }
+    arg++;
+  }
+
+  struct wl_proxy *result =
+      marshal_hook(proxy, opcode, interface, version, flags, args);
+
+  if (result) {
+    record.new_object = wl_proxy_get_id(result);
+    record.new_class = proxy_class(result);
+  }
+  if (class == PROXY_CLASS_WL_SURFACE && opcode == WL_SURFACE_ATTACH &&
+      args[0].o) {
+    uintptr_t shape = lf_map_lookup(&buffer_shape_map, args[0].o);
+    record.shape = shape == SHAPE_NONE ? CAPTURE_SHAPE_NONE : shape;
+  }
+  uint64_t index = atomic_fetch_add_explicit(&capture->head, 1,
+                                             memory_order_relaxed) %
+                   capture->capacity;
+  capture_records[index] = record;
+  return result;
+}
+
+static void init_capture(void) {
+  const char *pattern = getenv("WLCURSORFIX_CAPTURE");
+  if (!pattern || !*pattern) {
+    return;
+  }
+  uint64_t capacity = CAPTURE_DEFAULT_RECORDS;
+  const char *records_env = getenv("WLCURSORFIX_CAPTURE_RECORDS");
+  if (records_env && *records_env) {
+    capacity = strtoull(records_env, NULL, 10);
+  }
+  if (capacity == 0) {
+    return;
+  }
+  struct stats_buffer path = {.length = 0};
+  expand_pid_path(&path, pattern);
+  size_t size = sizeof(struct capture_header) +
+                capacity * sizeof(struct capture_record);
+  int fd = open(path.data, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    log_debug("couldn't open capture file %s: %s", path.data, strerror(errno));
+    return;
+  }
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    log_debug("couldn't map capture file %s: %s", path.data, strerror(errno));
+    return;
+  }
+  capture = mapping;
+  capture_records = (struct capture_record *)(capture + 1);
+  memcpy(capture->magic, CAPTURE_MAGIC, sizeof(capture->magic));
+  capture->version = CAPTURE_VERSION;
+  capture->record_size = sizeof(struct capture_record);
+  capture->capacity = capacity;
+  for (int i = 0; i < sizeof(proxy_class_list) / sizeof(*proxy_class_list);
+       i++) {
+    snprintf(capture->class_names[proxy_class_list[i].class],
+             CAPTURE_CLASS_NAME_SIZE, "%s", proxy_class_list[i].name);
+  }
+  marshal_armed = marshal_capture;
+  atomic_store(&marshal_impl, marshal_capture);
+  log_debug("capturing up to %" PRIu64 " requests to %s", capacity, path.data);
+}
+
+//
+// Pass-through mode
+//
+
+// Without a cursor shape manager there is nothing for the marshal hook to do,
+// since set_cursor can only go out as it is. A wl_display.sync sent right after
+// a registry is created comes back once the compositor has announced all of its
+// globals. If by then no display has a cursor shape manager, requests go
+// straight to libwayland from then on. A manager bound later on, on any
+// display, arms the hook again; objects created in the meantime are not
+// tracked, so those just keep using buffers.
+
+static void registry_burst_done(void *data, struct wl_callback *callback,
+                                uint32_t callback_data) {
+  wl_callback_destroy(callback);
+  lock_mutex(&mutex);
+  // A capture should show what the hook would see, so keep it armed.
+  if (atomic_load(&cursor_shape_manager_count) == 0 && !capture &&
+      atomic_exchange(&marshal_impl, marshal_passthrough) !=
+          marshal_passthrough) {
+    log_debug("no wp_cursor_shape_manager_v1, passing requests through");
+  }
+  mtx_unlock(&mutex);
+}
+
+static const struct wl_callback_listener registry_burst_listener = {
+    registry_burst_done,
+};
+
+static void watch_registry_burst(struct wl_proxy *registry) {
+  struct wl_proxy *wrapper = wl_proxy_create_wrapper(registry->display);
+  if (!wrapper) {
+    return;
+  }
+  // Deliver it wherever the application dispatches the registry's events.
+  wl_proxy_set_queue(wrapper, registry->queue);
+  struct wl_callback *callback = wl_display_sync((struct wl_display *)wrapper);
+  wl_proxy_wrapper_destroy(wrapper);
+  if (callback) {
+    wl_callback_add_listener(callback, &registry_burst_listener, NULL);
+  }
+}
+
+//
+// Cursor surfaces
+//
+
+// Toolkits tend to keep one cursor surface per pointer, attach and commit to it
+// once, and then only re-send set_cursor with it on every wl_pointer.enter. We
+// remember what the buffer last attached to each cursor surface mapped to, so
+// that those bare set_cursor requests can go straight to set_shape.
+
+static void remember_surface_shape(struct wl_surface *surface,
+                                   unsigned int shape) {
+  if (lf_map_lookup(&surface_shapes, surface) != shape) {
+    lf_map_insert(&surface_shapes, surface, shape);
+  }
+}
+
+// Forget the shape of a surface that got a new buffer or is going away.
+static void forget_surface_shape(struct wl_surface *surface) {
+  if (lf_map_lookup(&surface_shapes, surface) != 0) {
+    lf_map_remove(&surface_shapes, surface);
+  }
+}
+
+//
+// Object lifecycle
+//
+
+// Forget everything we know about a proxy that is about to be destroyed, so
+// that our tables don't grow without bound and a recycled address can't pick
+// up stale state.
+static void forget_proxy(struct wl_proxy *proxy, enum proxy_class class) {
+  switch (class) {
+  case PROXY_CLASS_WL_BUFFER:
+    forget_buffer_shape((struct wl_buffer *)proxy);
+    forget_shm_buffer(proxy);
+    break;
+  case PROXY_CLASS_WL_SHM_POOL:
+    forget_shm_pool(proxy);
+    break;
+  case PROXY_CLASS_WL_SURFACE:
+    forget_surface_shape((struct wl_surface *)proxy);
+    forget_deferred_set_cursor(proxy);
+    break;
+  case PROXY_CLASS_WP_VIEWPORT:
+  case PROXY_CLASS_WP_FRACTIONAL_SCALE_V1:
+    lf_map_remove(&surface_addons, proxy);
+    break;
+  case PROXY_CLASS_WL_POINTER:
+  case PROXY_CLASS_ZWP_TABLET_TOOL_V2:
+    release_cursor_shape_device(proxy);
+    forget_deferred_set_cursor(proxy);
+    break;
+  case PROXY_CLASS_WL_REGISTRY:
+    if (wl_proxy_get_listener(proxy) == &registry_listener) {
+      free(wl_proxy_get_user_data(proxy));
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+//
+// Placeholder cursor themes
+//
+
+// When WLCURSORFIX_NO_PIXELS is set and the compositor supports
+// cursor-shape-v1, wl_cursor_theme_load hands out placeholder themes instead of
+// loading Xcursor files. Cursors we have a shape for get a single transparent
+// image backed by a stub buffer that is registered in buffer_shape_map, so the
+// usual set_cursor rewriting turns them into set_shape. The stub buffers all
+// share one memfd pool that is never written to, so it costs no memory. Names
+// we don't have a shape for are served from a real theme loaded on demand.
+
+// Mirrors libwayland-cursor's struct cursor_image, so that the theme pointer
+// can be read from any wl_cursor_image to tell placeholders apart.
+struct placeholder_image {
+  struct wl_cursor_image image;
+  struct placeholder_theme *theme;
+  struct wl_buffer *buffer;
+};
+
+struct placeholder_cursor {
+  struct wl_cursor cursor;
+  struct wl_cursor_image *images[1];
+  struct placeholder_image image;
+  struct placeholder_cursor *next;
+};
+
+struct placeholder_theme {
+  mtx_t lock;
+  char *name;
+  int size;
+  struct wl_shm *shm;
+  struct wl_shm_pool *pool;
+  // Stub buffers, indexed by shape
+  struct wl_buffer *buffers[64];
+  struct placeholder_cursor *cursors;
+  // Real theme for cursors we don't have a shape for, loaded on demand
+  struct wl_cursor_theme *real;
+};
+
+static bool no_pixels_enabled(void) {
+  static atomic_int enabled = -1;
+  int value = atomic_load(&enabled);
+  if (value < 0) {
+    const char *env = getenv("WLCURSORFIX_NO_PIXELS");
+    value = env && *env && strcmp(env, "0") != 0;
+    atomic_store(&enabled, value);
+  }
+  return value;
+}
+
+static struct placeholder_theme *
+placeholder_theme_from(struct wl_cursor_theme *theme) {
+  if (!theme || lf_map_lookup(&placeholder_themes, theme) == 0) {
+    return NULL;
+  }
+  return (struct placeholder_theme *)theme;
+}
+
+// Shapes whose hotspot sits in the middle of the image rather than at the tip
+// of an arrow.
+static bool shape_has_centered_hotspot(unsigned int shape) {
+  switch (shape) {
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_DEFAULT:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_CONTEXT_MENU:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_HELP:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_POINTER:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_PROGRESS:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_ALIAS:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_COPY:
+  case WP_CURSOR_SHAPE_DEVICE_V1_SHAPE_NO_DROP:
+    return false;
+  default:
+    return true;
+  }
+}
+
+static struct placeholder_theme *
+placeholder_theme_create(const char *name, int size, struct wl_shm *shm) {
+  if (size <= 0) {
+    return NULL;
+  }
+  int32_t length = size * size * 4;
+  int fd = memfd_create("wlcursorfix-placeholder", MFD_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, length) < 0) {
+    close(fd);
+    return NULL;
+  }
+  struct placeholder_theme *theme = calloc(1, sizeof(*theme));
+  if (!theme) {
+    close(fd);
+    return NULL;
+  }
+  mtx_init(&theme->lock, mtx_plain);
+  theme->name = name ? strdup(name) : NULL;
+  theme->size = size;
+  theme->shm = shm;
+  theme->pool = wl_shm_create_pool(shm, fd, length);
+  close(fd);
+  lf_map_insert(&placeholder_themes, theme, 1);
+  log_debug("created placeholder cursor theme %p (%s, %d)", theme,
+            name ? name : "default", size);
+  return theme;
+}
+
+static struct wl_cursor *
+placeholder_theme_get_cursor(struct placeholder_theme *theme,
+                             const char *name) {
+  unsigned int shape = cursor_alias_shape(name);
+  if (shape >= sizeof(theme->buffers) / sizeof(*theme->buffers)) {
+    // No shape for this one, so it needs actual pixels.
+    lock_mutex(&theme->lock);
+    if (!theme->real) {
+      log_debug("loading real cursor theme for %s", name);
+      theme->real = real.wl_cursor_theme_load(theme->name, theme->size,
+                                              theme->shm);
+    }
+    mtx_unlock(&theme->lock);
+    if (!theme->real) {
+      return NULL;
+    }
+    return real.wl_cursor_theme_get_cursor(theme->real, name);
+  }
+
+  lock_mutex(&theme->lock);
+  struct placeholder_cursor *cursor;
+  for (cursor = theme->cursors; cursor; cursor = cursor->next) {
+    if (strcmp(cursor->cursor.name, name) == 0) {
+      mtx_unlock(&theme->lock);
+      return &cursor->cursor;
+    }
+  }
+  if (!theme->buffers[shape]) {
+    theme->buffers[shape] =
+        wl_shm_pool_create_buffer(theme->pool, 0, theme->size, theme->size,
+                                  theme->size * 4, WL_SHM_FORMAT_ARGB8888);
+    store_buffer_shape(theme->buffers[shape], shape);
+  }
+  cursor = calloc(1, sizeof(*cursor));
+  if (!cursor) {
+    mtx_unlock(&theme->lock);
+    return NULL;
+  }
+  cursor->cursor.name = strdup(name);
+  cursor->cursor.image_count = 1;
+  cursor->cursor.images = cursor->images;
+  cursor->images[0] = &cursor->image.image;
+  cursor->image.image.width = theme->size;
+  cursor->image.image.height = theme->size;
+  if (shape_has_centered_hotspot(shape)) {
+    cursor->image.image.hotspot_x = theme->size / 2;
+    cursor->image.image.hotspot_y = theme->size / 2;
+  }
+  cursor->image.theme = theme;
+  cursor->image.buffer = theme->buffers[shape];
+  cursor->next = theme->cursors;
+  theme->cursors = cursor;
+  mtx_unlock(&theme->lock);
+  return &cursor->cursor;
+}
+
+static void placeholder_theme_destroy(struct placeholder_theme *theme) {
+  lf_map_remove(&placeholder_themes, theme);
+  while (theme->cursors) {
+    struct placeholder_cursor *cursor = theme->cursors;
+    theme->cursors = cursor->next;
+    free(cursor->cursor.name);
+    free(cursor);
+  }
+  for (int i = 0; i < sizeof(theme->buffers) / sizeof(*theme->buffers); i++) {
+    if (theme->buffers[i]) {
+      wl_buffer_destroy(theme->buffers[i]);
+    }
+  }
+  wl_shm_pool_destroy(theme->pool);
+  if (theme->real) {
+    real.wl_cursor_theme_destroy(theme->real);
+  }
+  mtx_destroy(&theme->lock);
+  free(theme->name);
+  free(theme);
+}
+
+//
+// Wayland Hooks
+//
+
+int wl_proxy_add_listener(struct wl_proxy *proxy, void (**implementation)(void),
+                          void *data) {
+  ensure_init();
+  if (proxy_class(proxy) == PROXY_CLASS_WL_REGISTRY) {
+    log_debug("installing listener proxy for wl_registry");
+    registry_hook_data *hook_data = malloc(sizeof(registry_hook_data));
+    hook_data->data = data;
+    hook_data->implementation = (struct wl_registry_listener *)implementation;
+    implementation = (void (**)(void)) & registry_listener;
+    data = (void *)hook_data;
+    int result = real.wl_proxy_add_listener(proxy, implementation, data);
+    if (result != 0) {
+      free(hook_data);
+      return result;
+    }
+    if (in_gtk_init) {
+      in_gtk_init = false;
+      gdk_wayland_display = hook_data->data;
+      log_debug("captured GdkWaylandDisplay: %p", gdk_wayland_display);
+    }
+    watch_registry_burst(proxy);
+    return result;
+  }
+  if (proxy_class(proxy) == PROXY_CLASS_ZWP_TABLET_TOOL_V2) {
+    // Tablet tools are created by zwp_tablet_seat_v2.tool_added, and the
+    // application sets up their listener from that event. It is the first we
+    // get to see of the tool.
+    int result = real.wl_proxy_add_listener(proxy, implementation, data);
+    if (result == 0) {
+      watch_cursor_shape_device(proxy, true);
+    }
+    return result;
+  }
+  return real.wl_proxy_add_listener(proxy, implementation, data);
+}
+
+// Proxies without a destructor request (wl_registry, wl_pointer before version
+// 3, ...) are destroyed here; the others come through the marshal hook with
+// WL_MARSHAL_FLAG_DESTROY.
+void wl_proxy_destroy(struct wl_proxy *proxy) {
+  ensure_init();
+  if (proxy != NULL) {
+    forget_proxy(proxy, proxy_class(proxy));
+  }
+  real.wl_proxy_destroy(proxy);
+}
+
+struct wl_cursor_theme *wl_cursor_theme_load(const char *name, int size,
+                                             struct wl_shm *shm) {
+  ensure_init();
+  if (no_pixels_enabled() && shm &&
+      display_has_cursor_shape_manager(((struct wl_proxy *)shm)->display)) {
+    struct placeholder_theme *theme =
+        placeholder_theme_create(name, size, shm);
+    if (theme) {
+      return (struct wl_cursor_theme *)theme;
+    }
+  }
+  return real.wl_cursor_theme_load(name, size, shm);
+}
+
+void wl_cursor_theme_destroy(struct wl_cursor_theme *theme) {
+  ensure_init();
+  struct placeholder_theme *placeholder = placeholder_theme_from(theme);
+  if (placeholder) {
+    placeholder_theme_destroy(placeholder);
+    return;
+  }
+  lf_map_remove_value(&shape_cursors, (uintptr_t)theme);
+  lf_map_remove_value(&registered_cursors, (uintptr_t)theme);
+  real.wl_cursor_theme_destroy(theme);
+}
+
+// Whether cursor is animated but shown through set_shape, in which case the
+// compositor animates it and the client shouldn't bother.
+static bool cursor_animation_is_moot(struct wl_cursor *cursor) {
+  return cursor->image_count > 1 &&
+         atomic_load_explicit(&cursor_shape_manager_count,
+                              memory_order_relaxed) > 0 &&
+         lf_map_lookup(&shape_cursors, cursor) != 0;
+}
+
+// For shape-mapped cursors, always report the first frame with a duration of
+// 0, which is what libwayland-cursor reports for a static cursor: clients take
+// it to mean there is no next frame to schedule.
+int wl_cursor_frame_and_duration(struct wl_cursor *cursor, uint32_t time,
+                                 uint32_t *duration) {
+  ensure_init();
+  if (cursor_animation_is_moot(cursor)) {
+    if (duration) {
+      *duration = 0;
+    }
+    return 0;
+  }
+  return real.wl_cursor_frame_and_duration(cursor, time, duration);
+}
+
+int wl_cursor_frame(struct wl_cursor *cursor, uint32_t time) {
+  ensure_init();
+  if (cursor_animation_is_moot(cursor)) {
+    return 0;
+  }
+  return real.wl_cursor_frame(cursor, time);
+}
+
+struct wl_cursor *wl_cursor_theme_get_cursor(struct wl_cursor_theme *theme,
+                                             const char *name) {
+  ensure_init();
+  struct placeholder_theme *placeholder = placeholder_theme_from(theme);
+  if (placeholder) {
+    return placeholder_theme_get_cursor(placeholder, name);
+  }
+  struct wl_cursor *cursor = real.wl_cursor_theme_get_cursor(theme, name);
+  if (!cursor) {
+    return NULL;
+  }
+  // Some toolkits look the cursor up again on every motion event. A theme
+  // hands out the same wl_cursor for a name for as long as it lives, and
+  // its buffers never change, so there is nothing to do after the first time.
+  if (lf_map_lookup(&registered_cursors, cursor) == (uintptr_t)theme) {
+    stat_add(STAT_get_cursor_memo_hits, 1);
+    return cursor;
+  }
+  register_wl_cursor_buffers(theme, name, cursor);
+  lf_map_insert(&registered_cursors, cursor, (uintptr_t)theme);
+  return cursor;
+}
+
+struct wl_buffer *wl_cursor_image_get_buffer(struct wl_cursor_image *image) {
+  ensure_init();
+  struct placeholder_image *placeholder = (struct placeholder_image *)image;
+  if (placeholder_theme_from((struct wl_cursor_theme *)placeholder->theme)) {
+    return placeholder->buffer;
+  }
+  return real.wl_cursor_image_get_buffer(image);
+}
+
+//
+// Deferred set_cursor
+//
+
+// set_cursor requests are held back until we see what gets attached to the
+// cursor surface. If the buffer maps to a shape, set_shape goes out instead
+// and the surface's requests are dropped up to its commit, since the surface
+// is never going to be shown. If it doesn't, or the application moves on to
+// something unrelated first, the original set_cursor is flushed after all.
+//
+// Toolkits send more than attach and commit to a cursor surface, especially
+// with fractional scaling: damage, frame callbacks, buffer scale and transform,
+// offsets and viewport state. None of that has to reach the compositor if the
+// cursor ends up as a shape. State requests that come before the attach are
+// kept in a small log, so they can be replayed in order if we fall back.
+//
+// Each cursor surface has its own deferral, so that interleaved set_cursor
+// requests for several pointers and tablet tools each end up as set_shape. A
+// set_cursor only resolves an earlier one for the same device or surface.
+
+#define DEFERRED_SLOTS 4
+#define DEFERRED_LOG_SIZE 8
+// Surface state requests have at most four arguments, none of them objects.
+#define DEFERRED_MAX_ARGS 4
+
+struct deferred_request {
+  struct wl_proxy *proxy;
+  uint32_t opcode;
+  uint32_t version;
+  union wl_argument args[DEFERRED_MAX_ARGS];
+};
+
+// One set_cursor deferred on this thread.
+struct deferred_set_cursor {
+  struct wl_proxy *object;
+  uint32_t version;
+  uint32_t enter_serial;
+  struct wl_surface *pointer_surface;
+  int32_t x, y;
+  // set_shape was sent in place of set_cursor, so there is nothing left to
+  // flush; we are only waiting for the surface's commit.
+  bool mapped;
+  unsigned int log_count;
+  struct deferred_request log[DEFERRED_LOG_SIZE];
+};
+
+// Pending deferrals, oldest first. Each one is keyed by its cursor surface, so
+// that a client updating the cursors of several seats, or of a pointer and a
+// tablet tool, back to back gets each of them resolved on its own.
+static thread_local struct {
+  unsigned int count;
+  struct deferred_set_cursor slots[DEFERRED_SLOTS];
+} deferred_set_cursors;
+
+static void release_deferred_slot(unsigned int index) {
+  struct deferred_set_cursor *slots = deferred_set_cursors.slots;
+  deferred_set_cursors.count--;
+  memmove(&slots[index], &slots[index + 1],
+          (deferred_set_cursors.count - index) * sizeof(*slots));
+}
+
+// Send a deferred set_cursor after all, followed by the surface requests we
+// held back for it.
+static void send_deferred_set_cursor(struct deferred_set_cursor *deferred) {
+  union wl_argument args[4] = {
+      {.u = deferred->enter_serial},
+      {.o = (struct wl_object *)deferred->pointer_surface},
+      {.i = deferred->x},
+      {.i = deferred->y},
+  };
+  TRACE(set_cursor_flushed, deferred->object, NULL, 0);
+  stat_add(STAT_set_cursor_flushed, 1);
+  cursor_shape_superseded(deferred->object);
+  real.wl_proxy_marshal_array_flags(deferred->object, WL_POINTER_SET_CURSOR,
+                                    NULL, deferred->version, 0, args);
+  for (unsigned int i = 0; i < deferred->log_count; i++) {
+    struct deferred_request *request = &deferred->log[i];
+    real.wl_proxy_marshal_array_flags(request->proxy, request->opcode, NULL,
+                                      request->version, 0, request->args);
+  }
+}
+
+static void flush_deferred_slot(unsigned int index) {
+  send_deferred_set_cursor(&deferred_set_cursors.slots[index]);
+  release_deferred_slot(index);
+}
+
+// Flush the slot if set_cursor is still outstanding, otherwise just stop
+// watching its surface.
+static void resolve_deferred_slot(unsigned int index) {
+  if (deferred_set_cursors.slots[index].mapped) {
+    release_deferred_slot(index);
+  } else {
+    flush_deferred_slot(index);
+  }
+}
+
+static int find_deferred_slot(struct wl_surface *surface) {
+  for (unsigned int i = 0; i < deferred_set_cursors.count; i++) {
+    if (deferred_set_cursors.slots[i].pointer_surface == surface) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Flush every set_cursor that is still outstanding, in the order they came in.
+// Slots that were mapped to a shape stay, waiting for their commit.
+static void flush_unmapped_deferrals(void) {
+  struct deferred_set_cursor *slots = deferred_set_cursors.slots;
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < deferred_set_cursors.count; i++) {
+    if (!slots[i].mapped) {
+      send_deferred_set_cursor(&slots[i]);
+      continue;
+    }
+    if (kept != i) {
+      slots[kept] = slots[i];
+    }
+    kept++;
+  }
+  deferred_set_cursors.count = kept;
+}
+
+// Drop this thread's deferrals for a pointer, tablet tool or surface that is
+// going away. Other threads' deferrals can't be reached from here, but a
+// thread destroying an object it still has set_cursor requests in flight for
+// would be racing libwayland itself.
+static void forget_deferred_set_cursor(struct wl_proxy *proxy) {
+  for (unsigned int i = deferred_set_cursors.count; i-- > 0;) {
+    struct deferred_set_cursor *deferred = &deferred_set_cursors.slots[i];
+    if (deferred->object == proxy ||
+        (struct wl_proxy *)deferred->pointer_surface == proxy) {
+      release_deferred_slot(i);
+    }
+  }
+}
+
+// The same for every deferral on a display that is being disconnected.
+static void forget_display_deferrals(struct wl_display *display) {
+  for (unsigned int i = deferred_set_cursors.count; i-- > 0;) {
+    if (deferred_set_cursors.slots[i].object->display == display) {
+      release_deferred_slot(i);
+    }
+  }
+}
+
+// Hold back a surface state request until we know whether we need it.
+static bool log_deferred_request(struct deferred_set_cursor *deferred,
+                                 struct wl_proxy *proxy, uint32_t opcode,
+                                 uint32_t version, union wl_argument *args) {
+  if (deferred->log_count == DEFERRED_LOG_SIZE) {
+    return false;
+  }
+  // Only copy as many arguments as the request has; the caller's array may be
+  // no longer than that.
+  unsigned int arg_count = 0;
+  const char *signature = proxy->object.interface->methods[opcode].signature;
+  for (; *signature; signature++) {
+    arg_count += *signature >= 'a' && *signature <= 'z';
+  }
+  if (arg_count > DEFERRED_MAX_ARGS) {
+    return false;
+  }
+  struct deferred_request *request = &deferred->log[deferred->log_count++];
+  request->proxy = proxy;
+  request->opcode = opcode;
+  request->version = version;
+  memcpy(request->args, args, arg_count * sizeof(*args));
+  return true;
+}
+
+// The surface a request applies to, for surfaces and objects extending them.
+static struct wl_surface *request_surface(struct wl_proxy *proxy,
+                                          enum proxy_class class) {
+  switch (class) {
+  case PROXY_CLASS_WL_SURFACE:
+    return (struct wl_surface *)proxy;
+  case PROXY_CLASS_WP_VIEWPORT:
+  case PROXY_CLASS_WP_FRACTIONAL_SCALE_V1:
+    return (struct wl_surface *)lf_map_lookup(&surface_addons, proxy);
+  default:
+    return NULL;
+  }
+}
+
+// Stand in for a wl_surface.frame we are not going to send. The surface won't
+// be committed, so the compositor would never fire the real one; a
+// wl_display.sync on the surface's queue fires as soon as the compositor gets
+// to it, which keeps animation loops going. If we end up falling back after
+// all, the application just sees that frame callback a little early.
+static struct wl_proxy *substitute_frame_callback(
+    struct wl_proxy *surface, const struct wl_interface *interface,
+    uint32_t version, union wl_argument *args) {
+  struct wl_proxy *wrapper = wl_proxy_create_wrapper(surface->display);
+  if (!wrapper) {
+    return NULL;
+  }
+  wl_proxy_set_queue(wrapper, surface->queue);
+  struct wl_proxy *callback = real.wl_proxy_marshal_array_flags(
+      wrapper, WL_DISPLAY_SYNC, interface, version, 0, args);
+  wl_proxy_wrapper_destroy(wrapper);
+  return callback;
+}
+
+static struct wl_proxy *
+marshal_hook(struct wl_proxy *proxy, uint32_t opcode,
+             const struct wl_interface *interface, uint32_t version,
+             uint32_t flags, union wl_argument *args) {
+  const enum proxy_class class = proxy_class(proxy);
+
+  // Fast path: nothing is deferred on this thread and this is not a request we
+  // care about.
+  if (class == PROXY_CLASS_OTHER && deferred_set_cursors.count == 0) {
+    return real.wl_proxy_marshal_array_flags(proxy, opcode, interface,
+                                             version, flags, args);
+  }
+
+  const enum request_action action = request_action(class, opcode);
+  if (action == REQUEST_SURFACE_ADDON_CREATE) {
+    // Remember which surface the new object belongs to. This never needs a
+    // deferred set_cursor flushed.
+    struct wl_proxy *addon = real.wl_proxy_marshal_array_flags(
+        proxy, opcode, interface, version, flags, args);
+    if (addon && args[1].o) {
+      lf_map_insert(&surface_addons, addon, (uintptr_t)args[1].o);
+    }
+    return addon;
+  }
+  const int index = deferred_set_cursors.count > 0
+                        ? find_deferred_slot(request_surface(proxy, class))
+                        : -1;
+  if (index >= 0) {
+    struct deferred_set_cursor *deferred = &deferred_set_cursors.slots[index];
+    const bool mapped = deferred->mapped;
+    unsigned int shape;
+    switch (action) {
+    case REQUEST_SURFACE_ADDON_DESTROY:
+      // Unless it might be referenced from the log, let it go.
+      if (!mapped && deferred->log_count > 0) {
+        break;
+      }
+      forget_proxy(proxy, class);
+      return real.wl_proxy_marshal_array_flags(proxy, opcode, interface,
+                                               version, flags, args);
+    case REQUEST_SURFACE_ATTACH:
+      shape = lookup_buffer_shape((struct wl_buffer *)args[0].o);
+      if (shape == 0) {
+        TRACE(attach_unmapped, proxy, args[0].o, 0);
+        break;
+      }
+      struct cursor_shape_device *cursor_shape_device =
+          get_cursor_shape_device(deferred->object);
+      if (!cursor_shape_device) {
+        break;
+      }
+      TRACE(attach_mapped, proxy, args[0].o, shape);
+      set_cursor_shape(cursor_shape_device, deferred->enter_serial, shape);
+      remember_surface_shape(deferred->pointer_surface, shape);
+      deferred->mapped = true;
+      deferred->log_count = 0;
+      stat_add(STAT_requests_intercepted, 1);
+      return NULL;
+    case REQUEST_SURFACE_STATE:
+      if (!mapped &&
+          !log_deferred_request(deferred, proxy, opcode, version, args)) {
+        break;
+      }
+      stat_add(STAT_requests_intercepted, 1);
+      return NULL;
+    case REQUEST_SURFACE_FRAME: {
+      struct wl_proxy *callback =
+          substitute_frame_callback(proxy, interface, version, args);
+      if (!callback) {
+        break;
+      }
+      stat_add(STAT_requests_intercepted, 1);
+      return callback;
+    }
+    case REQUEST_SURFACE_COMMIT:
+      if (!mapped) {
+        // Committing whatever the surface already had; it needs to be shown.
+        break;
+      }
+      // Still mask this, but also stop watching the surface now.
+      release_deferred_slot(index);
+      stat_add(STAT_requests_intercepted, 1);
+      return NULL;
+    default:
+      if (mapped) {
+        // Anything else is harmless to send, since the surface is not shown.
+        if (flags & WL_MARSHAL_FLAG_DESTROY) {
+          forget_proxy(proxy, class);
+        }
+        return real.wl_proxy_marshal_array_flags(proxy, opcode, interface,
+                                                 version, flags, args);
+      }
+      break;
+    }
+    // The surface is going to be shown after all. Deferrals for other cursor
+    // surfaces are not affected by this.
+    flush_deferred_slot(index);
+  } else if (action != REQUEST_SET_CURSOR) {
+    // The application moved on without attaching anything we recognize, so
+    // send the deferred set_cursor requests now.
+    flush_unmapped_deferrals();
+  }
+  // If the next Wayland call is wl_pointer_set_cursor or
+  // zwp_tablet_tool_v2_set_cursor, defer it, unless it hides the cursor or
+  // there is no cursor shape device to send set_shape to instead. This
+  // replaces an earlier deferral for the same device, and any for the same
+  // surface, since the surface's requests can't be told apart between them.
+  // Deferrals for other devices stay where they are.
+  if (action == REQUEST_SET_CURSOR) {
+    struct wl_surface *pointer_surface = (struct wl_surface *)args[1].o;
+    for (unsigned int i = 0; i < deferred_set_cursors.count;) {
+      const struct deferred_set_cursor *deferred =
+          &deferred_set_cursors.slots[i];
+      if (deferred->object == proxy ||
+          (pointer_surface && deferred->pointer_surface == pointer_surface)) {
+        resolve_deferred_slot(i);
+      } else {
+        i++;
+      }
+    }
+    struct cursor_shape_device *cursor_shape_device =
+        pointer_surface ? get_cursor_shape_device(proxy) : NULL;
+    if (cursor_shape_device == NULL) {
+      cursor_shape_superseded(proxy);
+      return real.wl_proxy_marshal_array_flags(proxy, opcode, interface,
+                                               version, flags, args);
+    }
+    if (deferred_set_cursors.count == DEFERRED_SLOTS) {
+      resolve_deferred_slot(0);
+    }
+    struct deferred_set_cursor *deferred =
+        &deferred_set_cursors.slots[deferred_set_cursors.count++];
+    deferred->object = proxy;
+    deferred->version = version;
+    deferred->enter_serial = args[0].u;
+    deferred->pointer_surface = pointer_surface;
+    deferred->x = args[2].i;
+    deferred->y = args[3].i;
+    deferred->mapped = false;
+    deferred->log_count = 0;
+    unsigned int shape = lf_map_lookup(&surface_shapes, pointer_surface);
+    if (shape) {
+      // We already know what this surface shows. Should the application
+      // attach something new to it after all, that is still handled as usual.
+      TRACE(set_cursor_memo_hit, pointer_surface, NULL, shape);
+      set_cursor_shape(cursor_shape_device, args[0].u, shape);
+      deferred->mapped = true;
+      stat_add(STAT_set_cursor_memo_hits, 1);
+      return NULL;
+    }
+    stat_add(STAT_set_cursor_deferred, 1);
+    TRACE(set_cursor_deferred, proxy, NULL, 0);
+    return NULL;
+  }
+  if (action == REQUEST_SURFACE_ATTACH) {
+    forget_surface_shape((struct wl_surface *)proxy);
+  }
+  if (action == REQUEST_SEAT_GET_POINTER) {
+    struct wl_proxy *pointer = real.wl_proxy_marshal_array_flags(
+        proxy, opcode, interface, version, flags, args);
+    if (pointer) {
+      watch_cursor_shape_device(pointer, false);
+    }
+    return pointer;
+  }
+  if (action == REQUEST_SHM_CREATE_POOL) {
+    struct wl_proxy *pool = real.wl_proxy_marshal_array_flags(
+        proxy, opcode, interface, version, flags, args);
+    track_shm_pool(pool, args[1].h, args[2].i);
+    return pool;
+  }
+  if (action == REQUEST_SHM_POOL_CREATE_BUFFER) {
+    struct wl_proxy *buffer = real.wl_proxy_marshal_array_flags(
+        proxy, opcode, interface, version, flags, args);
+    track_shm_buffer(proxy, buffer, args[1].i, args[2].i, args[3].i,
+                     args[4].i, args[5].u);
+    return buffer;
+  }
+  if (flags & WL_MARSHAL_FLAG_DESTROY) {
+    forget_proxy(proxy, class);
+  }
+  return real.wl_proxy_marshal_array_flags(proxy, opcode, interface, version,
+                                           flags, args);
+}
+
+// Destructors still have to be seen in pass-through mode, so that nothing we
+// tracked before outlives its object.
+static struct wl_proxy *
+marshal_passthrough(struct wl_proxy *proxy, uint32_t opcode,
+                    const struct wl_interface *interface, uint32_t version,
+                    uint32_t flags, union wl_argument *args) {
+  if (flags & WL_MARSHAL_FLAG_DESTROY) {
+    forget_proxy(proxy, proxy_class(proxy));
+  }
+  return real.wl_proxy_marshal_array_flags(proxy, opcode, interface, version,
+                                           flags, args);
+}
+
+// Until the first request goes out, wl_proxy_marshal_array_flags lands here.
+static struct wl_proxy *
+marshal_bootstrap(struct wl_proxy *proxy, uint32_t opcode,
+                  const struct wl_interface *interface, uint32_t version,
+                  uint32_t flags, union wl_argument *args) {
+  ensure_init();
+  // init may already have swapped in marshal_capture.
+  marshal_array_flags_fn expected = marshal_bootstrap;
+  atomic_compare_exchange_strong(&marshal_impl, &expected, marshal_armed);
+  return atomic_load(&marshal_impl)(proxy, opcode, interface, version, flags,
+                                    args);
+}
+
+struct wl_proxy *
+wl_proxy_marshal_array_flags(struct wl_proxy *proxy, uint32_t opcode,
+                             const struct wl_interface *interface,
+                             uint32_t version, uint32_t flags,
+                             union wl_argument *args) {
+  return atomic_load_explicit(&marshal_impl, memory_order_relaxed)(
+      proxy, opcode, interface, version, flags, args);
+}
+
+// A set_cursor for a surface that already has its content committed is never
+// followed by an attach, so it would only go out with the thread's next
+// request, which may be a long time coming in an idle application. Resolve it
+// whenever the thread flushes its requests or is about to block on events.
+// A deferral that already went out as set_shape is just dropped: once the
+// application has flushed, the attach and commit it was waiting for are not
+// coming, and a surface without the cursor role can be committed harmlessly.
+// Only the calling thread's deferrals are resolved: another thread's deferred
+// requests haven't been sent yet, so they can't be reordered by our flush.
+static inline void resolve_deferred_set_cursor(void) {
+  if (deferred_set_cursors.count == 0) {
+    return;
+  }
+  // Nothing to send for mapped slots. Stop watching their surfaces, so that
+  // the thread goes back to the fast path.
+  for (unsigned int i = 0; i < deferred_set_cursors.count; i++) {
+    if (!deferred_set_cursors.slots[i].mapped) {
+      send_deferred_set_cursor(&deferred_set_cursors.slots[i]);
+    }
+  }
+  deferred_set_cursors.count = 0;
+}
+
+int wl_display_flush(struct wl_display *display) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_flush(display);
+}
+
+int wl_display_dispatch(struct wl_display *display) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_dispatch(display);
+}
+
+int wl_display_dispatch_queue(struct wl_display *display,
+                              struct wl_event_queue *queue) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_dispatch_queue(display, queue);
+}
+
+int wl_display_dispatch_pending(struct wl_display *display) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_dispatch_pending(display);
+}
+
+int wl_display_dispatch_queue_pending(struct wl_display *display,
+                                      struct wl_event_queue *queue) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_dispatch_queue_pending(display, queue);
+}
+
+int wl_display_roundtrip(struct wl_display *display) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_roundtrip(display);
+}
+
+int wl_display_roundtrip_queue(struct wl_display *display,
+                               struct wl_event_queue *queue) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_roundtrip_queue(display, queue);
+}
+
+int wl_display_prepare_read(struct wl_display *display) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_prepare_read(display);
+}
+
+int wl_display_prepare_read_queue(struct wl_display *display,
+                                  struct wl_event_queue *queue) {
+  ensure_init();
+  resolve_deferred_set_cursor();
+  flush_coalesced_shapes(display);
+  return real.wl_display_prepare_read_queue(display, queue);
+}
+
+void wl_display_disconnect(struct wl_display *display) {
+  ensure_init();
+  if (display) {
+    release_display_context(display);
+  }
+  real.wl_display_disconnect(display);
+}
+
+//
+// GTK hooks
+//
+
+static struct gtk_wl_cursor_theme *(*_gdk_wayland_display_get_cursor_theme)(
+    void *display) = NULL;
+
+// Reverse index of the current GTK cursor theme, mapping each image buffer to
+// its shape, or to SHAPE_NONE for buffers we know aren't in the theme. GTK
+// loads cursors and sizes on demand, so the index is extended incrementally
+// from the cursors and images that appeared since the last sync, and thrown
+// away when GTK switches to a different theme (e.g. after a scale change).
+static struct {
+  mtx_t lock;
+  struct gtk_wl_cursor_theme *theme;
+  struct gtk_wl_cursor **cursors;
+  // Number of cursors, and images of each cursor, indexed so far.
+  unsigned int cursor_count;
+  unsigned int *image_counts;
+  unsigned int image_counts_capacity;
+  struct ptr_map index;
+} gtk_theme_index = {.index = PTR_MAP_INIT};
+
+static unsigned int gtk_cursor_name_shape(const char *name) {
+  unsigned int shape = name ? cursor_alias_shape(name) : SHAPE_NONE;
+  if (shape == SHAPE_NONE) {
+    log_debug("no cursor image for name %s", name ? name : "(null)");
+  }
+  return shape;
+}
+
+// Whether the theme has loaded cursors or images we have not indexed yet.
+static bool gtk_theme_index_stale(struct gtk_wl_cursor_theme *theme) {
+  if (theme->cursor_count != gtk_theme_index.cursor_count) {
+    return true;
+  }
+  for (unsigned int i = 0; i < theme->cursor_count; i++) {
+    if (theme->cursors[i]->image_count != gtk_theme_index.image_counts[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void gtk_theme_index_reset(struct gtk_wl_cursor_theme *theme) {
+  log_debug("indexing new GTK cursor theme %p", theme);
+  ptr_map_clear(&gtk_theme_index.index);
+  gtk_theme_index.theme = theme;
+  gtk_theme_index.cursors = theme->cursors;
+  gtk_theme_index.cursor_count = 0;
+}
+
+// Index the cursors and images that were loaded since the last sync.
+static void gtk_theme_index_sync(struct gtk_wl_cursor_theme *theme) {
+  stat_add(STAT_gtk_theme_scans, 1);
+  if (theme->cursor_count > gtk_theme_index.image_counts_capacity) {
+    unsigned int capacity = theme->cursor_count * 2;
+    unsigned int *image_counts = realloc(gtk_theme_index.image_counts,
+                                         capacity * sizeof(*image_counts));
+    if (!image_counts) {
+      return;
+    }
+    gtk_theme_index.image_counts = image_counts;
+    gtk_theme_index.image_counts_capacity = capacity;
+  }
+  for (unsigned int i = 0; i < theme->cursor_count; i++) {
+    struct gtk_wl_cursor *cursor = theme->cursors[i];
+    unsigned int first = 0;
+    if (i < gtk_theme_index.cursor_count) {
+      first = gtk_theme_index.image_counts[i];
+      if (first == cursor->image_count) {
+        continue;
+      }
+    }
+    unsigned int shape = gtk_cursor_name_shape(cursor->name);
+    stat_add(STAT_gtk_images_visited, cursor->image_count - first);
+    for (unsigned int j = first; j < cursor->image_count; j++) {
+      struct wl_buffer *buffer = cursor->images[j]->buffer;
+      if (buffer) {
+        ptr_map_insert(&gtk_theme_index.index, buffer, shape);
+      }
+    }
+    gtk_theme_index.image_counts[i] = cursor->image_count;
+  }
+  gtk_theme_index.cursor_count = theme->cursor_count;
+}
+
+static unsigned int
+gtk_cursor_theme_buffer_shape(struct gtk_wl_cursor_theme *theme,
+                              struct wl_buffer *buffer) {
+  lock_mutex(&gtk_theme_index.lock);
+  if (theme != gtk_theme_index.theme ||
+      theme->cursors != gtk_theme_index.cursors ||
+      theme->cursor_count < gtk_theme_index.cursor_count) {
+    gtk_theme_index_reset(theme);
+  }
+  unsigned int shape = ptr_map_lookup(&gtk_theme_index.index, buffer);
+  if (shape == 0 || (shape == SHAPE_NONE && gtk_theme_index_stale(theme))) {
+    gtk_theme_index_sync(theme);
+    shape = ptr_map_lookup(&gtk_theme_index.index, buffer);
+    if (shape == 0) {
+      // Not in the theme as it is now; remember that until it grows.
+      ptr_map_insert(&gtk_theme_index.index, buffer, SHAPE_NONE);
+      shape = SHAPE_NONE;
+    }
+  }
+  mtx_unlock(&gtk_theme_index.lock);
+  if (shape == SHAPE_NONE) {
+    return 0;
+  }
+  store_buffer_shape(buffer, shape);
+  TRACE(gtk_buffer_registered, NULL, buffer, shape);
+  return shape;
+}
+
+static void gtk_theme_index_forget_buffer(struct wl_buffer *buffer) {
+  lock_mutex(&gtk_theme_index.lock);
+  ptr_map_remove(&gtk_theme_index.index, buffer);
+  mtx_unlock(&gtk_theme_index.lock);
+}
+
+static unsigned int
+gdk_wayland_display_cursor_buffer_shape(void *display,
+                                        struct wl_buffer *buffer) {
+  struct gtk_wl_cursor_theme *theme =
+      _gdk_wayland_display_get_cursor_theme(display);
+  if (!theme) {
+    return 0;
+  }
+  return gtk_cursor_theme_buffer_shape(theme, buffer);
+}
+
+//
+// Private symbol lookup
+//
+
+// GTK4 doesn't export the symbols we need, so we look them up in the symbol
+// table of the library file. The file is mapped rather than read, and since
+// parsing it is still the most expensive thing we do at startup, resolved
+// symbols are cached on disk keyed by the library's GNU build ID. Many
+// distributions strip .symtab and ship MiniDebugInfo instead: an xz-compressed
+// ELF in .gnu_debugdata holding just the symbol table. We decompress that with
+// liblzma, loaded on demand so it isn't a dependency of every process.
+
+// Just the parts of the liblzma ABI we need.
+#define LZMA_OK 0
+#define LZMA_BUF_ERROR 10
+typedef int (*lzma_stream_buffer_decode_fn)(uint64_t *memlimit, uint32_t flags,
+                                            const void *allocator,
+                                            const uint8_t *in, size_t *in_pos,
+                                            size_t in_size, uint8_t *out,
+                                            size_t *out_pos, size_t out_size);
+
+// MiniDebugInfo is small; refuse to inflate anything absurd.
+#define MAX_DEBUGDATA_SIZE (64 << 20)
+
+static bool elf_range_valid(size_t size, uint64_t offset, uint64_t length) {
+  return offset <= size && length <= size - offset;
+}
+
+static bool elf_find_symbol(const unsigned char *image, size_t size,
+                            const char *symbol, bool allow_debugdata,
+                            ElfW(Addr) *value);
+
+// Find symbol in the MiniDebugInfo of an ELF image.
+static bool elf_find_debugdata_symbol(const unsigned char *data,
+                                      size_t data_size, const char *symbol,
+                                      ElfW(Addr) *value) {
+  void *lzma = dlopen("liblzma.so.5", RTLD_LAZY | RTLD_LOCAL);
+  if (!lzma) {
+    log_debug("liblzma not available, can't read .gnu_debugdata");
+    return false;
+  }
+  bool found = false;
+  lzma_stream_buffer_decode_fn decode =
+      (lzma_stream_buffer_decode_fn)dlsym(lzma, "lzma_stream_buffer_decode");
+  size_t out_size = data_size * 4;
+  uint8_t *out = NULL;
+  while (decode && out_size <= MAX_DEBUGDATA_SIZE) {
+    uint8_t *grown = realloc(out, out_size);
+    if (!grown) {
+      break;
+    }
+    out = grown;
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos = 0, out_pos = 0;
+    int result = decode(&memlimit, 0, NULL, data, &in_pos, data_size, out,
+                        &out_pos, out_size);
+    if (result == LZMA_OK) {
+      found = elf_find_symbol(out, out_pos, symbol, false, value);
+      break;
+    }
+    if (result != LZMA_BUF_ERROR) {
+      log_debug("couldn't decompress .gnu_debugdata: %d", result);
+      break;
+    }
+    out_size *= 2;
+  }
+  free(out);
+  dlclose(lzma);
+  return found;
+}
+
+// Find symbol in the symbol table of an in-memory ELF image, falling back to
+// its MiniDebugInfo if allowed.
+static bool elf_find_symbol(const unsigned char *image, size_t size,
+                            const char *symbol, bool allow_debugdata,
+                            ElfW(Addr) *value) {
+  const ElfW(Ehdr) *header = (const ElfW(Ehdr) *)image;
+  if (size < sizeof(*header) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+      header->e_shentsize != sizeof(ElfW(Shdr)) ||
+      !elf_range_valid(size, header->e_shoff,
+                       (uint64_t)header->e_shnum * sizeof(ElfW(Shdr))) ||
+      header->e_shstrndx >= header->e_shnum) {
+    log_debug("not a usable ELF image");
+    return false;
+  }
+  const ElfW(Shdr) *sections = (const ElfW(Shdr) *)(image + header->e_shoff);
+  const ElfW(Shdr) *shstr = &sections[header->e_shstrndx];
+  if (!elf_range_valid(size, shstr->sh_offset, shstr->sh_size)) {
+    return false;
+  }
+  const char *shstrtab = (const char *)image + shstr->sh_offset;
+
+  const ElfW(Shdr) *debugdata = NULL;
+  for (int i = 0; i < header->e_shnum; i++) {
+    const ElfW(Shdr) *section = &sections[i];
+    if (section->sh_name < shstr->sh_size &&
+        strcmp(shstrtab + section->sh_name, ".gnu_debugdata") == 0) {
+      debugdata = section;
+    }
+    if (section->sh_type != SHT_SYMTAB || section->sh_link >= header->e_shnum ||
+        section->sh_entsize != sizeof(ElfW(Sym))) {
+      continue;
+    }
+    const ElfW(Shdr) *strtab_section = &sections[section->sh_link];
+    if (!elf_range_valid(size, section->sh_offset, section->sh_size) ||
+        !elf_range_valid(size, strtab_section->sh_offset,
+                         strtab_section->sh_size)) {
+      continue;
+    }
+    const ElfW(Sym) *symbols = (const ElfW(Sym) *)(image + section->sh_offset);
+    const char *strtab = (const char *)image + strtab_section->sh_offset;
+    size_t symbol_count = section->sh_size / sizeof(ElfW(Sym));
+    size_t symbol_length = strlen(symbol);
+    for (size_t j = 0; j < symbol_count; j++) {
+      ElfW(Word) name = symbols[j].st_name;
+      if (symbols[j].st_value != 0 &&
+          name + symbol_length < strtab_section->sh_size &&
+          memcmp(strtab + name, symbol, symbol_length + 1) == 0) {
+        *value = symbols[j].st_value;
+        return true;
+      }
+    }
+  }
+  if (allow_debugdata && debugdata &&
+      elf_range_valid(size, debugdata->sh_offset, debugdata->sh_size)) {
+    log_debug("looking for %s in .gnu_debugdata", symbol);
+    return elf_find_debugdata_symbol(image + debugdata->sh_offset,
+                                     debugdata->sh_size, symbol, value);
+  }
+  return false;
+}
+
+// Find symbol in the symbol table of the ELF file at path.
+static bool elf_file_find_symbol(const char *path, const char *symbol,
+                                 ElfW(Addr) *value) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    log_debug("couldn't open %s: %s", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    log_debug("couldn't map %s: %s", path, strerror(errno));
+    return false;
+  }
+  bool found = elf_find_symbol(image, st.st_size, symbol, true, value);
+  munmap(image, st.st_size);
+  return found;
+}
+
+// Get the hex GNU build ID of a loaded object from its program headers.
+static bool elf_build_id(const ElfW(Ehdr) *header, ElfW(Addr) load_bias,
+                         char *hex, size_t hex_size) {
+  const ElfW(Phdr) *phdrs =
+      (const ElfW(Phdr) *)((const char *)header + header->e_phoff);
+  for (int i = 0; i < header->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_NOTE) {
+      continue;
+    }
+    const char *note = (const char *)(load_bias + phdrs[i].p_vaddr);
+    const char *end = note + phdrs[i].p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+      const char *name = note + sizeof(*nhdr);
+      const unsigned char *desc =
+          (const unsigned char *)name + ((nhdr->n_namesz + 3) & ~3u);
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz * 2 < hex_size) {
+        for (unsigned int j = 0; j < nhdr->n_descsz; j++) {
+          snprintf(hex + j * 2, 3, "%02x", desc[j]);
+        }
+        return true;
+      }
+      note = (const char *)desc + ((nhdr->n_descsz + 3) & ~3u);
     }
-    void *addr = (void *)((const char *)header + symbol->st_value);
-    if (strcmp(name, "_gdk_wayland_display_get_cursor_theme") == 0) {
-      _gdk_wayland_display_get_cursor_theme = addr;
+  }
+  return false;
+}
+
+// The cache has one "<build id> <symbol> <hex value>" line per entry.
+static bool symbol_cache_lookup(const char *build_id, const char *symbol,
+                                ElfW(Addr) *value) {
+  char path[PATH_MAX];
+  if (!cache_path(path, sizeof(path), "symbols", false)) {
+    return false;
+  }
+  FILE *f = fopen(path, "re");
+  if (!f) {
+    return false;
+  }
+  bool found = false;
+  char line[512], entry_build_id[128], entry_symbol[256];
+  unsigned long long entry_value;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%127s %255s %llx", entry_build_id, entry_symbol,
+               &entry_value) == 3 &&
+        strcmp(entry_build_id, build_id) == 0 &&
+        strcmp(entry_symbol, symbol) == 0) {
+      *value = entry_value;
+      found = true;
+      break;
     }
   }
+  fclose(f);
+  return found;
+}
+
+static void symbol_cache_store(const char *build_id, const char *symbol,
+                               ElfW(Addr) value) {
+  char path[PATH_MAX], line[512];
+  if (!cache_path(path, sizeof(path), "symbols", true)) {
+    return;
+  }
+  int length = snprintf(line, sizeof(line), "%s %s %llx\n", build_id, symbol,
+                        (unsigned long long)value);
+  if (length < 0 || length >= sizeof(line)) {
+    return;
+  }
+  // A single small O_APPEND write, so concurrent processes don't interleave.
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  if (write(fd, line, length) != length) {
+    log_debug("couldn't write symbol cache %s", path);
+  }
+  close(fd);
+}
+
+// Resolve a private symbol of the loaded object that contains address.
+static void *resolve_private_symbol(void *address, const char *symbol) {
+  Dl_info info;
+  struct link_map *map;
+  if (!dladdr1(address, &info, (void **)&map, RTLD_DL_LINKMAP)) {
+    log_debug("error resolving object info for %s", symbol);
+    return NULL;
+  }
+  char build_id[128];
+  bool have_build_id =
+      elf_build_id(info.dli_fbase, map->l_addr, build_id, sizeof(build_id));
+  ElfW(Addr) value;
+  if (have_build_id && symbol_cache_lookup(build_id, symbol, &value)) {
+    log_debug("resolved %s from symbol cache", symbol);
+    return (void *)(map->l_addr + value);
+  }
+  if (!elf_file_find_symbol(info.dli_fname, symbol, &value)) {
+    return NULL;
+  }
+  if (have_build_id) {
+    symbol_cache_store(build_id, symbol, value);
+  }
+  return (void *)(map->l_addr + value);
+}
+
+static void init_gtk_hook_once(void) {
+  // We need to get a private (STB_LOCAL) symbol from symtab.
+  // Warning: This code may cause severe psychic damage to sensible people.
+  mtx_init(&gtk_theme_index.lock, mtx_plain);
+  // The GTK hooks can run before init, and GTK may not have been loaded yet
+  // when init ran if the application loaded it with dlopen.
+  if (!real.gtk_init || !real.g_application_run) {
+    RESOLVE_REAL(g_application_run);
+    RESOLVE_REAL(gtk_init);
+  }
+  // TODO: maybe try to find a better symbol that reliably detects only GTK4
+  void *gtk_init = (void *)real.gtk_init;
+  if (!gtk_init) {
+    log_debug("no resident gtk found");
+    return;
+  }
+  Dl_info gtk_info;
+  if (!dladdr(gtk_init, &gtk_info)) {
+    log_debug("error resolving gtk_init info");
+    return;
+  }
+  if (strstr(gtk_info.dli_fname, "libgtk-4.so") == NULL) {
+    log_debug("detected gtk but not gtk4");
+    return;
+  }
+  _gdk_wayland_display_get_cursor_theme =
+      resolve_private_symbol(gtk_init, "_gdk_wayland_display_get_cursor_theme");
   if (!_gdk_wayland_display_get_cursor_theme) {
-    g_debug("couldn't resolve _gdk_wayland_display_get_cursor_theme");
+    log_debug("couldn't resolve _gdk_wayland_display_get_cursor_theme");
     return;
   }
-  g_debug("resolved gtk module as %s", gtk_info.dli_fname);
+  log_debug("resolved gtk module as %s", gtk_info.dli_fname);
   have_gtk4 = true;
 }
 
+static void init_gtk_hook(void) {
+  static once_flag once = ONCE_FLAG_INIT;
+  call_once(&once, init_gtk_hook_once);
+}
+
 // We need to hook GTK4 at gtk_init, but it is compiled with -Bsymbolic, so
 // internal calls to gtk_init are not possible to catch. Therefore, applications
 // that don't call gtk_init directly first will need special interception.
@@ -602,27 +3986,19 @@ static void init_gtk_hook() {
 // may call gtk_init earlier.
 int g_application_run(void *application, int argc, char **argv) {
   init_gtk_hook();
-  static int (*next)(void *, int, char **);
-  if (!next) {
-    next = dlsym(RTLD_NEXT, "g_application_run");
-  }
   if (have_gtk4 && gdk_wayland_display == NULL) {
     in_gtk_init = true;
   }
-  int result = next(application, argc, argv);
+  int result = real.g_application_run(application, argc, argv);
   in_gtk_init = false;
   return result;
 }
 
 void gtk_init(void *a, void *b) {
   init_gtk_hook();
-  static void (*next)(void *, void *);
-  if (!next) {
-    next = dlsym(RTLD_NEXT, "gtk_init");
-  }
   if (have_gtk4 && gdk_wayland_display == NULL) {
     in_gtk_init = true;
   }
-  next(a, b);
+  real.gtk_init(a, b);
   in_gtk_init = false;
 }